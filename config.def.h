@@ -20,7 +20,124 @@ static unsigned int height = 800;
  */
 static int customshape = 1;
 
-#define MAX_IMAGE_COUNT 1024
+#define MAX_IMAGE_COUNT 16384
+
+/*
+ * Images found in a directory are laid out on a grid of gridcolumns
+ * columns, each image is shrunk to fit a square cell of gridcell pixels.
+ */
+static size_t gridcell = 512;
+static size_t gridcolumns = 16;
+
+/*
+ * Images with at least pyramidpixels pixels get a multi-resolution copy
+ * stored in $XDG_CACHE_HOME/sref, it is used instead of decoding the
+ * image the next time it is opened.  Set to 0 to disable the cache.
+ */
+static size_t pyramidpixels = 4096 * 4096;
+static size_t pyramidtile = 256;
+
+/*
+ * Number of threads decoding images, 0 for one per CPU.
+ */
+static int nworkers = 0;
+
+/*
+ * Interlaced PNG and progressive JPEG with at least previewpixels pixels
+ * are shown at low resolution while they are being decoded.
+ */
+static size_t previewpixels = 2048 * 2048;
+
+/*
+ * QOI images are decoded and uploaded by bands of about bandbytes.
+ */
+static size_t bandbytes = 1024 * 1024;
+
+/*
+ * Images up to pbobytes are decoded straight into a mapped pixel buffer
+ * object, larger ones are decoded in memory.
+ */
+static size_t pbobytes = 64 * 1024 * 1024;
+
+/*
+ * Images can be compressed to ETC2 in the background, which takes a
+ * quarter to an eighth of the video memory, and the compressed copy is
+ * kept in the cache for the next time.  The compression is lossy and
+ * some drivers decode ETC2 in software, so it is off by default.  The
+ * quality goes from 0, the fastest, to 2, the slowest, -1 keeps the
+ * images uncompressed.
+ */
+static int etc2quality = -1;
+
+/*
+ * Textures use up to texbytes of video memory, past that the images out
+ * of view are evicted and uploaded again once back in view.  Evicted
+ * images are kept in memory as QOI, up to rambytes, and are read again
+ * from the disk past that.  Set to 0 for no limit.
+ */
+static size_t texbytes = 1024 * 1024 * 1024;
+static size_t rambytes = 512 * 1024 * 1024;
+
+/*
+ * Memory pressure from /proc/pressure/memory, when some or all tasks are
+ * stalled waiting for memory for psisome or psifull milliseconds within
+ * two seconds, the copies of evicted images are dropped, the textures budget
+ * is cut and large images use a smaller level of their pyramid.  All is
+ * back to normal after psirelax seconds without pressure.  Set to 0 to
+ * ignore the pressure.
+ */
+static unsigned int psisome = 200;
+static unsigned int psifull = 100;
+static unsigned int psirelax = 10;
+
+/*
+ * While the view is grabbed and panned, images it reaches within
+ * prefetchahead seconds are loaded ahead of time.  Set to 0 to disable.
+ */
+static float prefetchahead = 0.5;
+
+/*
+ * The images and the session file are reloaded when their file changes,
+ * reloaddelay seconds after the last change.  Set to -1 to not watch them.
+ */
+static float reloaddelay = 0.3;
+
+/*
+ * New session files are written in the binary format when binarysession
+ * is set, in the text format otherwise.  Both formats are read, and an
+ * existing session file is written back in the format it was read in.
+ */
+static int binarysession = 0;
+
+/*
+ * The changes of the board are appended to a journal next to the session
+ * file, flushed to the disk journalsync seconds after they are made.  The
+ * session file is written again once the journal is over journalbytes.
+ * Set journalbytes to 0 to not keep a journal.
+ */
+static float journalsync = 1.0;
+static size_t journalbytes = 1024 * 1024;
+
+/*
+ * Number of moves and scales of images kept to be undone with Ctrl+Z,
+ * and redone with Ctrl+Y, a drag is one of them.
+ */
+static size_t undosteps = 4096;
+
+/*
+ * Ctrl+Shift+A packs the images in rows, arrangegap pixels apart,
+ * centered on the view, they slide to their place in arrangetime seconds.
+ */
+static int arrangegap = 8;
+static float arrangetime = 0.4;
+
+/*
+ * The images read from the stream given with -i replace each other on
+ * the board when streamreplace is set, they are laid out on a grid
+ * otherwise.  Frames larger than streambytes, read or decoded, are skipped.
+ */
+static int streamreplace = 1;
+static size_t streambytes = 256 * 1024 * 1024;
 
 /*
  * State bits to ignore when matching key or button events.  By default,
@@ -35,4 +152,10 @@ struct shortcut shortcuts[] = {
 	{ XK_ANY_MOD,           XK_Home,        zoomreset },
 	{ XK_ANY_MOD,           XK_S,           saveboard },
 	{ XK_ANY_MOD,           XK_B,           toggleshape },
+	{ ControlMask,          XK_V,           paste },
+	{ XK_ANY_MOD,           XK_C,           capture },
+	{ ControlMask|ShiftMask, XK_A,          arrange },
+	{ ControlMask,          XK_Z,           undo },
+	{ ControlMask|ShiftMask, XK_Z,          redo },
+	{ ControlMask,          XK_Y,           redo },
 };
@@ -9,9 +9,9 @@ MANPREFIX = $(PREFIX)/share/man
 
 # Depencies includes and libs
 INCS = `pkg-config --cflags x11 gl xrender xext`
-LIBS = -ldl -lm `pkg-config --libs x11 gl xrender xext`
+LIBS = -ldl -lm -lpthread `pkg-config --libs x11 gl xrender xext`
 
 # Flags
-CPPFLAGS += -DVERSION=\"$(VERSION)\" -D_POSIX_C_SOURCE=200809L
+CPPFLAGS += -DVERSION=\"$(VERSION)\" -D_POSIX_C_SOURCE=200809L -D_XOPEN_SOURCE=700 -D_DEFAULT_SOURCE
 CFLAGS += $(INCS) $(CPPFLAGS) -Wall -Wextra -O2 -g
 LDFLAGS += $(LIBS)
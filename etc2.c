@@ -0,0 +1,402 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <stdint.h>
+#include <string.h>
+
+#include "etc2.h"
+
+/*
+ * Colors are encoded with the ETC1 individual and differential modes,
+ * which are valid ETC2 blocks as long as the differential colors do not
+ * overflow.  Pixels of a block are numbered column by column, p = x * 4 + y.
+ */
+static const int etc1_mod[8][2] = {
+	{ 2, 8 }, { 5, 17 }, { 9, 29 }, { 13, 42 },
+	{ 18, 60 }, { 24, 80 }, { 33, 106 }, { 47, 183 },
+};
+
+static const int eac_mod[16][8] = {
+	{ -3, -6, -9, -15, 2, 5, 8, 14 },
+	{ -3, -7, -10, -13, 2, 6, 9, 12 },
+	{ -2, -5, -8, -13, 1, 4, 7, 12 },
+	{ -2, -4, -6, -13, 1, 3, 5, 12 },
+	{ -3, -6, -8, -12, 2, 5, 7, 11 },
+	{ -3, -7, -9, -11, 2, 6, 8, 10 },
+	{ -4, -7, -8, -11, 3, 6, 7, 10 },
+	{ -3, -5, -8, -11, 2, 4, 7, 10 },
+	{ -2, -6, -8, -10, 1, 5, 7, 9 },
+	{ -2, -5, -8, -10, 1, 4, 7, 9 },
+	{ -2, -4, -8, -10, 1, 3, 7, 9 },
+	{ -2, -5, -7, -10, 1, 4, 6, 9 },
+	{ -3, -4, -7, -10, 2, 3, 6, 9 },
+	{ -1, -2, -3, -10, 0, 1, 2, 9 },
+	{ -4, -6, -8, -9, 3, 5, 7, 8 },
+	{ -3, -5, -7, -9, 2, 4, 6, 8 },
+};
+
+struct block {
+	int rgb[16][3];
+	int a[16];
+};
+
+/* the pixels of the two halves of a block */
+struct half {
+	int p[8];
+	int avg[3];
+};
+
+struct color {
+	int q[2][3]; /* quantized base colors */
+	int table[2];
+	int idx[16];
+	unsigned long err;
+};
+
+static int
+clamp(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static int
+expand(int q, int bits)
+{
+	return bits == 4 ? q << 4 | q : q << 3 | q >> 2;
+}
+
+static int
+quantize(int v, int bits)
+{
+	int max = (1 << bits) - 1;
+
+	return (v * max + 127) / 255;
+}
+
+static void
+block_fetch(struct block *b, const unsigned char *px, int w, int h, int n, int bx, int by)
+{
+	int x, y, c;
+
+	for (x = 0; x < 4; x++) {
+		for (y = 0; y < 4; y++) {
+			/* the edges are padded with the last row and column */
+			int sx = bx + x < w ? bx + x : w - 1;
+			int sy = by + y < h ? by + y : h - 1;
+			const unsigned char *s = px + ((size_t)sy * w + sx) * n;
+			int p = x * 4 + y;
+
+			for (c = 0; c < 3; c++)
+				b->rgb[p][c] = n >= 3 ? s[c] : s[0];
+			b->a[p] = n == 4 ? s[3] : n == 2 ? s[1] : 255;
+		}
+	}
+}
+
+static void
+block_halves(const struct block *b, int flip, struct half h[2])
+{
+	int i[2] = { 0, 0 };
+	int p, c, s;
+
+	memset(h, 0, 2 * sizeof(*h));
+	for (p = 0; p < 16; p++) {
+		/* left and right halves, or top and bottom when flipped */
+		s = flip ? (p & 3) >= 2 : p >= 8;
+		h[s].p[i[s]++] = p;
+		for (c = 0; c < 3; c++)
+			h[s].avg[c] += b->rgb[p][c];
+	}
+	for (s = 0; s < 2; s++)
+		for (c = 0; c < 3; c++)
+			h[s].avg[c] = (h[s].avg[c] + 4) / 8;
+}
+
+/* error of the best table for a half with the base color q */
+static unsigned long
+half_encode(const struct block *b, const struct half *h, const int q[3], int bits,
+            int *table, int *idx)
+{
+	unsigned long best = -1, err;
+	int base[3], tidx[8];
+	int t, i, m, c;
+
+	for (c = 0; c < 3; c++)
+		base[c] = expand(q[c], bits);
+	for (t = 0; t < 8; t++) {
+		int mods[4] = {
+			etc1_mod[t][0], etc1_mod[t][1], -etc1_mod[t][0], -etc1_mod[t][1]
+		};
+
+		err = 0;
+		for (i = 0; i < 8 && err < best; i++) {
+			const int *px = b->rgb[h->p[i]];
+			unsigned long pbest = -1;
+
+			for (m = 0; m < 4; m++) {
+				unsigned long e = 0;
+				for (c = 0; c < 3; c++) {
+					int d = clamp(base[c] + mods[m]) - px[c];
+					e += d * d;
+				}
+				if (e < pbest) {
+					pbest = e;
+					tidx[i] = m;
+				}
+			}
+			err += pbest;
+		}
+		if (err < best) {
+			best = err;
+			*table = t;
+			for (i = 0; i < 8; i++)
+				idx[h->p[i]] = tidx[i];
+		}
+	}
+	return best;
+}
+
+/*
+ * Find the base color of a half around its average, quality 1 also
+ * tries a darker and a brighter color, quality 2 every neighbour.
+ * The color is kept within lo and hi when given.
+ */
+static unsigned long
+half_search(const struct block *b, const struct half *h, int bits, int quality,
+            const int *lo, const int *hi, int q[3], int *table, int *idx)
+{
+	int max = (1 << bits) - 1;
+	int center[3], cand[3], tidx[16];
+	unsigned long best = -1, err;
+	int d[3], t, c, r;
+
+	r = quality >= 2 ? 1 : 0;
+	for (c = 0; c < 3; c++)
+		center[c] = quantize(h->avg[c], bits);
+	for (d[0] = -r; d[0] <= r; d[0]++)
+	for (d[1] = -r; d[1] <= r; d[1]++)
+	for (d[2] = -r; d[2] <= r; d[2]++) {
+		int s, shifts = quality == 1 ? 3 : 1;
+
+		for (s = 0; s < shifts; s++) {
+			int l = s == 0 ? 0 : s == 1 ? -1 : 1;
+
+			for (c = 0; c < 3; c++) {
+				cand[c] = center[c] + d[c] + l;
+				if (cand[c] < 0)
+					cand[c] = 0;
+				if (cand[c] > max)
+					cand[c] = max;
+				if (lo && cand[c] < lo[c])
+					cand[c] = lo[c];
+				if (hi && cand[c] > hi[c])
+					cand[c] = hi[c];
+			}
+			err = half_encode(b, h, cand, bits, &t, tidx);
+			if (err < best) {
+				best = err;
+				memcpy(q, cand, sizeof(cand));
+				*table = t;
+				for (c = 0; c < 8; c++)
+					idx[h->p[c]] = tidx[h->p[c]];
+			}
+		}
+	}
+	return best;
+}
+
+static void
+color_individual(const struct block *b, const struct half h[2], int quality, struct color *col)
+{
+	int s;
+
+	col->err = 0;
+	for (s = 0; s < 2; s++)
+		col->err += half_search(b, &h[s], 4, quality, NULL, NULL,
+					col->q[s], &col->table[s], col->idx);
+}
+
+/* returns -1 if the halves are too far apart for the differential mode */
+static int
+color_differential(const struct block *b, const struct half h[2], int quality, struct color *col)
+{
+	int lo[3], hi[3];
+	int c, far = 0;
+
+	col->err = half_search(b, &h[0], 5, quality, NULL, NULL,
+			       col->q[0], &col->table[0], col->idx);
+	for (c = 0; c < 3; c++) {
+		int q = quantize(h[1].avg[c], 5);
+
+		lo[c] = col->q[0][c] - 4;
+		hi[c] = col->q[0][c] + 3;
+		if (q < lo[c] || q > hi[c])
+			far = 1;
+	}
+	col->err += half_search(b, &h[1], 5, quality, lo, hi,
+				col->q[1], &col->table[1], col->idx);
+	return far ? -1 : 0;
+}
+
+static void
+color_pack(unsigned char *out, const struct color *col, int diff, int flip)
+{
+	uint32_t hi, lo = 0;
+	int p;
+
+	if (diff) {
+		hi = (uint32_t)col->q[0][0] << 27 | ((col->q[1][0] - col->q[0][0]) & 7) << 24
+		   | col->q[0][1] << 19 | ((col->q[1][1] - col->q[0][1]) & 7) << 16
+		   | col->q[0][2] << 11 | ((col->q[1][2] - col->q[0][2]) & 7) << 8;
+	} else {
+		hi = (uint32_t)col->q[0][0] << 28 | col->q[1][0] << 24
+		   | col->q[0][1] << 20 | col->q[1][1] << 16
+		   | col->q[0][2] << 12 | col->q[1][2] << 8;
+	}
+	hi |= col->table[0] << 5 | col->table[1] << 2 | diff << 1 | flip;
+	for (p = 0; p < 16; p++)
+		lo |= (uint32_t)(col->idx[p] >> 1) << (16 + p) | (uint32_t)(col->idx[p] & 1) << p;
+
+	for (p = 0; p < 4; p++) {
+		out[p] = hi >> (24 - 8 * p);
+		out[4 + p] = lo >> (24 - 8 * p);
+	}
+}
+
+static void
+block_color(unsigned char *out, const struct block *b, int quality)
+{
+	struct half h[2];
+	struct color col, best = { 0 };
+	int flip, far, bestflip = 0, bestdiff = 0;
+
+	best.err = -1;
+	for (flip = 0; flip < 2; flip++) {
+		block_halves(b, flip, h);
+		far = color_differential(b, h, quality, &col) < 0;
+		if (col.err < best.err) {
+			best = col;
+			bestflip = flip;
+			bestdiff = 1;
+		}
+		if (far || quality > 1) {
+			color_individual(b, h, quality, &col);
+			if (col.err < best.err) {
+				best = col;
+				bestflip = flip;
+				bestdiff = 0;
+			}
+		}
+	}
+	color_pack(out, &best, bestdiff, bestflip);
+}
+
+static unsigned long
+alpha_error(const struct block *b, int base, int mult, int t, int *idx)
+{
+	unsigned long err = 0;
+	int p, i;
+
+	for (p = 0; p < 16; p++) {
+		int pbest = 1 << 30;
+
+		for (i = 0; i < 8; i++) {
+			int d = clamp(base + eac_mod[t][i] * mult) - b->a[p];
+			if (d * d < pbest) {
+				pbest = d * d;
+				idx[p] = i;
+			}
+		}
+		err += pbest;
+	}
+	return err;
+}
+
+static void
+block_alpha(unsigned char *out, const struct block *b, int quality)
+{
+	unsigned long best = -1, err;
+	int min = 255, max = 0;
+	int base = 0, mult = 1, table = 13;
+	int idx[16], tidx[16];
+	int p, t, m, d, r;
+	uint64_t bits;
+
+	for (p = 0; p < 16; p++) {
+		min = b->a[p] < min ? b->a[p] : min;
+		max = b->a[p] > max ? b->a[p] : max;
+	}
+	if (min == max) {
+		/* table 13 has a zero modifier */
+		base = min;
+		for (p = 0; p < 16; p++)
+			idx[p] = 4;
+	} else {
+		r = quality > 1 ? 1 : 0;
+		for (t = 0; t < 16; t++) {
+			int span = eac_mod[t][7] - eac_mod[t][3];
+			int m0 = (max - min + span / 2) / span;
+
+			for (m = m0 - r; m <= m0 + r; m++) {
+				int mm = m < 1 ? 1 : m > 15 ? 15 : m;
+				int b0 = min - eac_mod[t][3] * mm;
+
+				for (d = -r; d <= r; d++) {
+					int bb = clamp(b0 + d * mm);
+
+					err = alpha_error(b, bb, mm, t, tidx);
+					if (err < best) {
+						best = err;
+						base = bb;
+						mult = mm;
+						table = t;
+						memcpy(idx, tidx, sizeof(idx));
+					}
+				}
+			}
+		}
+	}
+
+	bits = (uint64_t)base << 56 | (uint64_t)mult << 52 | (uint64_t)table << 48;
+	for (p = 0; p < 16; p++)
+		bits |= (uint64_t)idx[p] << (45 - 3 * p);
+	for (p = 0; p < 8; p++)
+		out[p] = bits >> (56 - 8 * p);
+}
+
+int
+etc2_has_alpha(const unsigned char *px, size_t npx, int n)
+{
+	size_t i;
+
+	if (n != 2 && n != 4)
+		return 0;
+	for (i = 0; i < npx; i++)
+		if (px[i * n + n - 1] != 255)
+			return 1;
+	return 0;
+}
+
+size_t
+etc2_size(int w, int h, int alpha)
+{
+	return (size_t)((w + 3) / 4) * ((h + 3) / 4) * (alpha ? 16 : 8);
+}
+
+void
+etc2_encode(unsigned char *out, const unsigned char *px, int w, int h,
+            int n, int alpha, int quality)
+{
+	struct block b;
+	int x, y;
+
+	for (y = 0; y < h; y += 4) {
+		for (x = 0; x < w; x += 4) {
+			block_fetch(&b, px, w, h, n, x, y);
+			if (alpha) {
+				block_alpha(out, &b, quality);
+				out += 8;
+			}
+			block_color(out, &b, quality);
+			out += 8;
+		}
+	}
+}
@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef ETC2_H__
+#define ETC2_H__
+
+#include <stddef.h>
+
+/*
+ * ETC2 encoder for GLES 3.0 textures.  Opaque images are encoded as
+ * COMPRESSED_RGB8_ETC2, 8 bytes per 4x4 block, the others as
+ * COMPRESSED_RGBA8_ETC2_EAC, 16 bytes per block.  Images of 1 or 2
+ * channels are encoded as grey.  Blocks are stored row by row.
+ */
+
+/* returns 1 if any pixel of the image of n channels is not opaque */
+int etc2_has_alpha(const unsigned char *px, size_t npx, int n);
+
+/* returns the size of the encoded image */
+size_t etc2_size(int w, int h, int alpha);
+
+/* quality goes from 0, fastest, to 2, best */
+void etc2_encode(unsigned char *out, const unsigned char *px, int w, int h,
+                 int n, int alpha, int quality);
+
+#endif
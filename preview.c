@@ -0,0 +1,541 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "preview.h"
+
+#define ZSLACK (65535 + 258)
+
+/* implemented in stbi.c */
+int stbi_zlib_decode_prefix(char *obuffer, int olen, char const *ibuffer, int ilen);
+
+static uint32_t
+be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static int
+paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+
+	if (pa <= pb && pa <= pc)
+		return a;
+	if (pb <= pc)
+		return b;
+	return c;
+}
+
+/* undo the png filters of a pass in place, return 0 on bad filter */
+static int
+png_unfilter(unsigned char *raw, size_t rows, size_t rowsz, size_t bpp)
+{
+	unsigned char *prev = NULL;
+	unsigned char *cur;
+	size_t y, i;
+
+	for (y = 0; y < rows; y++) {
+		int f = raw[y * (rowsz + 1)];
+		cur = raw + y * (rowsz + 1) + 1;
+		for (i = 0; i < rowsz; i++) {
+			int a = i >= bpp ? cur[i - bpp] : 0;
+			int b = prev ? prev[i] : 0;
+			int c = prev && i >= bpp ? prev[i - bpp] : 0;
+
+			switch (f) {
+			case 0: break;
+			case 1: cur[i] += a; break;
+			case 2: cur[i] += b; break;
+			case 3: cur[i] += (a + b) / 2; break;
+			case 4: cur[i] += paeth(a, b, c); break;
+			default: return 0;
+			}
+		}
+		prev = cur;
+	}
+	return 1;
+}
+
+/*
+ * Adam7 interlaced PNG: the first pass holds one pixel out of 8x8, the
+ * third one completes the 4x4 grid and the fifth one the 2x2 grid.  Each
+ * of those is published as an image of 1/8, 1/4 and 1/2 resolution, only
+ * the beginning of the zlib stream needs to be inflated for them.
+ */
+int
+preview_png(const unsigned char *buf, size_t len, preview_fn fn, void *arg)
+{
+	static const unsigned char sig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	static const int x0[7] = { 0, 4, 0, 2, 0, 1, 0 };
+	static const int y0[7] = { 0, 0, 4, 0, 2, 0, 1 };
+	static const int dx[7] = { 8, 8, 4, 4, 2, 2, 1 };
+	static const int dy[7] = { 8, 8, 8, 4, 4, 2, 2 };
+	static const int stages[] = { 0, 2, 4 };
+	const unsigned char *p = buf + 8, *end = buf + len;
+	const unsigned char *plte = NULL;
+	unsigned char *idat = NULL, *raw = NULL, *out;
+	size_t idatlen = 0, plen = 0;
+	size_t w = 0, h = 0, ch, bpp, n, need, off;
+	int depth = 0, ctype = -1, interlace = 0;
+	int published = 0;
+	size_t s, k, pass;
+
+	if (len < 8 || memcmp(buf, sig, sizeof(sig)) != 0)
+		return 0;
+
+	/* gather the chunks, IDATs are concatenated */
+	while (end - p >= 12) {
+		uint32_t clen = be32(p);
+		const unsigned char *type = p + 4;
+		const unsigned char *data = p + 8;
+
+		if (clen > (size_t)(end - p) - 12)
+			break;
+		if (memcmp(type, "IHDR", 4) == 0 && clen >= 13) {
+			w = be32(data);
+			h = be32(data + 4);
+			depth = data[8];
+			ctype = data[9];
+			interlace = data[12];
+		} else if (memcmp(type, "PLTE", 4) == 0) {
+			plte = data;
+			plen = clen / 3;
+		} else if (memcmp(type, "IDAT", 4) == 0) {
+			unsigned char *np = realloc(idat, idatlen + clen);
+			if (!np)
+				goto out;
+			idat = np;
+			memcpy(idat + idatlen, data, clen);
+			idatlen += clen;
+		} else if (memcmp(type, "IEND", 4) == 0) {
+			break;
+		}
+		p += clen + 12;
+	}
+
+	if (interlace != 1 || !idat || w == 0 || h == 0 || idatlen > INT32_MAX)
+		goto out;
+	if (ctype == 0)
+		ch = 1;
+	else if (ctype == 2)
+		ch = 3;
+	else if (ctype == 3 && plte && depth == 8)
+		ch = 1;
+	else if (ctype == 4)
+		ch = 2;
+	else if (ctype == 6)
+		ch = 4;
+	else
+		goto out;
+	if (depth != 8 && depth != 16)
+		goto out;
+	bpp = ch * depth / 8;
+	n = ctype == 3 ? 3 : ch;
+
+	for (s = 0; s < sizeof(stages) / sizeof(*stages); s++) {
+		size_t last = stages[s];
+		size_t scale = dx[last];
+		size_t ow = (w + scale - 1) / scale;
+		size_t oh = (h + scale - 1) / scale;
+
+		need = 0;
+		for (pass = 0; pass <= last; pass++) {
+			size_t pw = w > (size_t)x0[pass] ? (w - x0[pass] + dx[pass] - 1) / dx[pass] : 0;
+			size_t ph = h > (size_t)y0[pass] ? (h - y0[pass] + dy[pass] - 1) / dy[pass] : 0;
+			if (pw && ph)
+				need += ph * (pw * bpp + 1);
+		}
+		/* inflate stops before a match or stored block that would overflow */
+		if (need > INT32_MAX - ZSLACK)
+			break;
+		free(raw);
+		raw = malloc(need + ZSLACK);
+		if (!raw)
+			break;
+		if ((size_t)stbi_zlib_decode_prefix((char *)raw, need + ZSLACK, (char *)idat, idatlen) < need)
+			break;
+
+		out = malloc(ow * oh * n);
+		if (!out)
+			break;
+		off = 0;
+		for (pass = 0; pass <= last; pass++) {
+			size_t pw = w > (size_t)x0[pass] ? (w - x0[pass] + dx[pass] - 1) / dx[pass] : 0;
+			size_t ph = h > (size_t)y0[pass] ? (h - y0[pass] + dy[pass] - 1) / dy[pass] : 0;
+			size_t rowsz = pw * bpp;
+			size_t i, j;
+
+			if (!pw || !ph)
+				continue;
+			if (!png_unfilter(raw + off, ph, rowsz, bpp)) {
+				free(out);
+				goto out;
+			}
+			for (j = 0; j < ph; j++) {
+				size_t y = y0[pass] + j * dy[pass];
+				const unsigned char *row = raw + off + j * (rowsz + 1) + 1;
+
+				if (y % scale)
+					continue;
+				for (i = 0; i < pw; i++) {
+					size_t x = x0[pass] + i * dx[pass];
+					const unsigned char *src = row + i * bpp;
+					unsigned char *dst;
+
+					if (x % scale)
+						continue;
+					dst = out + ((y / scale) * ow + x / scale) * n;
+					if (ctype == 3) {
+						const unsigned char *c = src[0] < plen ? plte + src[0] * 3 : plte;
+						dst[0] = c[0];
+						dst[1] = c[1];
+						dst[2] = c[2];
+					} else {
+						/* keep the most significant byte of 16 bit samples */
+						for (k = 0; k < n; k++)
+							dst[k] = src[k * depth / 8];
+					}
+				}
+			}
+			off += ph * (rowsz + 1);
+		}
+		fn(arg, out, ow, oh, n);
+		published++;
+	}
+out:
+	free(raw);
+	free(idat);
+	return published;
+}
+
+struct huffman {
+	unsigned char vals[256];
+	int mincode[17];
+	int maxcode[18];
+	int valptr[17];
+	int valid;
+};
+
+struct bitreader {
+	const unsigned char *p, *end;
+	uint32_t buf;
+	int bits;
+	int marker;
+};
+
+static void
+huffman_build(struct huffman *hf, const unsigned char *counts, const unsigned char *vals, int nvals)
+{
+	int code = 0, k = 0, l;
+
+	memcpy(hf->vals, vals, nvals);
+	for (l = 1; l <= 16; l++) {
+		hf->valptr[l] = k;
+		hf->mincode[l] = code;
+		code += counts[l - 1];
+		k += counts[l - 1];
+		hf->maxcode[l] = counts[l - 1] ? code - 1 : -1;
+		code <<= 1;
+	}
+	hf->maxcode[17] = INT32_MAX;
+	hf->valid = 1;
+}
+
+static int
+getbit(struct bitreader *b)
+{
+	if (b->bits == 0) {
+		int c = 0;
+
+		if (!b->marker && b->p < b->end) {
+			c = *b->p++;
+			if (c == 0xff) {
+				if (b->p < b->end && *b->p == 0) {
+					b->p++;
+				} else {
+					/* end of entropy coded data */
+					b->p--;
+					b->marker = 1;
+					c = 0;
+				}
+			}
+		}
+		b->buf = c;
+		b->bits = 8;
+	}
+	b->bits--;
+	return (b->buf >> b->bits) & 1;
+}
+
+static int
+getbits(struct bitreader *b, int n)
+{
+	int v = 0;
+
+	while (n--)
+		v = (v << 1) | getbit(b);
+	return v;
+}
+
+static int
+huffman_decode(struct bitreader *b, const struct huffman *hf)
+{
+	int code = getbit(b);
+	int l = 1;
+
+	while (l <= 16 && code > hf->maxcode[l]) {
+		code = (code << 1) | getbit(b);
+		l++;
+	}
+	if (l > 16)
+		return -1;
+	return hf->vals[(hf->valptr[l] + code - hf->mincode[l]) & 0xff];
+}
+
+static int
+extend(int v, int s)
+{
+	return v < (1 << (s - 1)) ? v - (1 << s) + 1 : v;
+}
+
+/*
+ * Progressive JPEG: the first scan only carries the DC coefficient of
+ * every 8x8 block, that is the average color of the block.  It is
+ * published as a 1/8 resolution image.
+ */
+int
+preview_jpeg(const unsigned char *buf, size_t len, preview_fn fn, void *arg)
+{
+	struct huffman dc[4] = { 0 };
+	struct {
+		int id, h, v, tq, td;
+		int bw, bh;
+		int *coef;
+		int inscan;
+	} comp[3] = { 0 };
+	int quant[4] = { 0 };
+	const unsigned char *p = buf + 2, *end = buf + len;
+	const unsigned char *sos = NULL;
+	int progressive = 0, ncomp = 0, restart = 0, soslen = 0;
+	int w = 0, h = 0, hmax = 1, vmax = 1;
+	int published = 0;
+	int c, i;
+
+	if (len < 4 || buf[0] != 0xff || buf[1] != 0xd8)
+		return 0;
+
+	while (end - p >= 4) {
+		int m, slen;
+		const unsigned char *seg;
+
+		if (p[0] != 0xff) {
+			p++;
+			continue;
+		}
+		m = p[1];
+		if (m == 0xff) {
+			p++;
+			continue;
+		}
+		slen = p[2] << 8 | p[3];
+		seg = p + 4;
+		if (slen < 2 || slen > end - p - 2)
+			break;
+		p += slen + 2;
+		slen -= 2;
+
+		if (m >= 0xc0 && m <= 0xcf && m != 0xc2 && m != 0xc4 && m != 0xc8 && m != 0xcc) {
+			break; /* baseline or lossless, no early pass */
+		} else if (m == 0xc2) {
+			if (slen < 6)
+				break;
+			h = seg[1] << 8 | seg[2];
+			w = seg[3] << 8 | seg[4];
+			ncomp = seg[5];
+			if ((ncomp != 1 && ncomp != 3) || slen < 6 + ncomp * 3 || !w || !h)
+				break;
+			for (c = 0; c < ncomp; c++) {
+				comp[c].id = seg[6 + c * 3];
+				comp[c].h = seg[7 + c * 3] >> 4;
+				comp[c].v = seg[7 + c * 3] & 15;
+				comp[c].tq = seg[8 + c * 3] & 3;
+				if (comp[c].h < 1 || comp[c].h > 4 || comp[c].v < 1 || comp[c].v > 4)
+					goto out;
+				hmax = comp[c].h > hmax ? comp[c].h : hmax;
+				vmax = comp[c].v > vmax ? comp[c].v : vmax;
+			}
+			progressive = 1;
+		} else if (m == 0xdb) {
+			const unsigned char *q = seg, *qend = seg + slen;
+			while (qend - q >= 65) {
+				int pq = q[0] >> 4;
+				int tq = q[0] & 3;
+				quant[tq] = pq ? (q[1] << 8 | q[2]) : q[1];
+				q += 1 + (pq ? 128 : 64);
+			}
+		} else if (m == 0xc4) {
+			const unsigned char *q = seg, *qend = seg + slen;
+			while (qend - q >= 17) {
+				int tc = q[0] >> 4;
+				int th = q[0] & 3;
+				int total = 0;
+				for (i = 0; i < 16; i++)
+					total += q[1 + i];
+				if (total > 256 || qend - q < 17 + total)
+					goto out;
+				if (tc == 0)
+					huffman_build(&dc[th], q + 1, q + 17, total);
+				q += 17 + total;
+			}
+		} else if (m == 0xdd) {
+			if (slen >= 2)
+				restart = seg[0] << 8 | seg[1];
+		} else if (m == 0xda) {
+			sos = seg;
+			soslen = slen;
+			break;
+		}
+	}
+	if (!progressive || !sos)
+		goto out;
+
+	{
+		int ns, ss, se, ah, al;
+		int mcux = (w + 8 * hmax - 1) / (8 * hmax);
+		int mcuy = (h + 8 * vmax - 1) / (8 * vmax);
+		int pred[3] = { 0 };
+		struct bitreader b = { 0 };
+		unsigned char *out;
+		int n = ncomp;
+		int pw = (w + 7) / 8;
+		int ph = (h + 7) / 8;
+		int x, y;
+		long mcu, nmcu, todo;
+
+		/* the first scan of a progressive JPEG is a DC scan */
+		ns = sos[0];
+		if (ns < 1 || ns > ncomp || soslen < 1 + ns * 2 + 3)
+			goto out;
+		ss = sos[1 + ns * 2];
+		se = sos[2 + ns * 2];
+		ah = sos[3 + ns * 2] >> 4;
+		al = sos[3 + ns * 2] & 15;
+		if (ss != 0 || se != 0 || ah != 0)
+			goto out;
+
+		for (c = 0; c < ncomp; c++) {
+			comp[c].bw = mcux * comp[c].h;
+			comp[c].bh = mcuy * comp[c].v;
+			comp[c].coef = calloc((size_t)comp[c].bw * comp[c].bh, sizeof(int));
+			if (!comp[c].coef)
+				goto out;
+		}
+		for (i = 0; i < ns; i++) {
+			int id = sos[1 + i * 2];
+			for (c = 0; c < ncomp; c++) {
+				if (comp[c].id != id)
+					continue;
+				comp[c].td = sos[2 + i * 2] >> 4 & 3;
+				comp[c].inscan = 1;
+				if (!dc[comp[c].td].valid)
+					goto out;
+			}
+		}
+		if (!comp[0].inscan)
+			goto out;
+
+		b.p = p;
+		b.end = end;
+		if (ns > 1) {
+			nmcu = (long)mcux * mcuy;
+		} else {
+			for (c = 0; !comp[c].inscan; c++)
+				;
+			/* a single component scan is not padded to whole MCUs */
+			nmcu = (long)((w * comp[c].h + 8 * hmax - 1) / (8 * hmax))
+			     * ((h * comp[c].v + 8 * vmax - 1) / (8 * vmax));
+		}
+		todo = restart;
+		for (mcu = 0; mcu < nmcu; mcu++) {
+			if (restart && todo-- == 0) {
+				/* skip the RSTn marker and reset the predictors */
+				todo = restart - 1;
+				b.bits = 0;
+				b.marker = 0;
+				if (end - b.p >= 2 && b.p[0] == 0xff && (b.p[1] & 0xf8) == 0xd0)
+					b.p += 2;
+				memset(pred, 0, sizeof(pred));
+			}
+			for (c = 0; c < ncomp; c++) {
+				int bx, by;
+				if (!comp[c].inscan)
+					continue;
+				if (ns == 1) {
+					int cw = (w * comp[c].h + 8 * hmax - 1) / (8 * hmax);
+					bx = mcu % cw;
+					by = mcu / cw;
+					if (bx < comp[c].bw && by < comp[c].bh) {
+						int s = huffman_decode(&b, &dc[comp[c].td]);
+						if (s < 0 || s > 11)
+							goto out;
+						pred[c] += s ? extend(getbits(&b, s), s) : 0;
+						comp[c].coef[by * comp[c].bw + bx] = pred[c] * (1 << al);
+					}
+					continue;
+				}
+				for (y = 0; y < comp[c].v; y++) {
+					for (x = 0; x < comp[c].h; x++) {
+						int s = huffman_decode(&b, &dc[comp[c].td]);
+						if (s < 0 || s > 11)
+							goto out;
+						pred[c] += s ? extend(getbits(&b, s), s) : 0;
+						bx = (mcu % mcux) * comp[c].h + x;
+						by = (mcu / mcux) * comp[c].v + y;
+						comp[c].coef[by * comp[c].bw + bx] = pred[c] * (1 << al);
+					}
+				}
+			}
+		}
+
+		out = malloc((size_t)pw * ph * n);
+		if (!out)
+			goto out;
+		for (y = 0; y < ph; y++) {
+			for (x = 0; x < pw; x++) {
+				int v[3] = { 128, 128, 128 };
+				unsigned char *d = out + ((size_t)y * pw + x) * n;
+
+				for (c = 0; c < ncomp; c++) {
+					int bx = x * comp[c].h / hmax;
+					int by = y * comp[c].v / vmax;
+					int q = quant[comp[c].tq] ? quant[comp[c].tq] : 1;
+					if (comp[c].inscan)
+						v[c] = comp[c].coef[by * comp[c].bw + bx] * q / 8 + 128;
+				}
+				if (n == 1) {
+					d[0] = v[0] < 0 ? 0 : v[0] > 255 ? 255 : v[0];
+				} else {
+					/* JFIF YCbCr to RGB */
+					float yy = v[0], cb = v[1] - 128, cr = v[2] - 128;
+					float rgb[3];
+					rgb[0] = yy + 1.402f * cr;
+					rgb[1] = yy - 0.344136f * cb - 0.714136f * cr;
+					rgb[2] = yy + 1.772f * cb;
+					for (i = 0; i < 3; i++)
+						d[i] = rgb[i] < 0 ? 0 : rgb[i] > 255 ? 255 : rgb[i] + 0.5f;
+				}
+			}
+		}
+		fn(arg, out, pw, ph, n);
+		published = 1;
+	}
+out:
+	for (c = 0; c < 3; c++)
+		free(comp[c].coef);
+	return published;
+}
@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef PREVIEW_H__
+#define PREVIEW_H__
+
+/*
+ * Decode the early low resolution passes of an interlaced PNG or of a
+ * progressive JPEG.  fn is called once per pass with a malloc'd buffer
+ * of w * h * n bytes, the buffer then belongs to fn.  Returns the number
+ * of passes published, 0 if the image is not progressive.
+ */
+typedef void (*preview_fn)(void *arg, unsigned char *data, int w, int h, int n);
+
+int preview_png(const unsigned char *buf, size_t len, preview_fn fn, void *arg);
+int preview_jpeg(const unsigned char *buf, size_t len, preview_fn fn, void *arg);
+
+#endif
@@ -1,2 +1,99 @@
+#include "qoidec.h"
 #define QOI_IMPLEMENTATION
 #include "qoi.h"
+
+int
+qoidec_init(struct qoidec *d, const void *data, size_t len, int channels)
+{
+	const unsigned char *bytes = data;
+	int p = 0;
+
+	if (len < QOI_HEADER_SIZE || (channels != 0 && channels != 3 && channels != 4))
+		return 0;
+
+	memset(d, 0, sizeof(*d));
+	if (qoi_read_32(bytes, &p) != QOI_MAGIC)
+		return 0;
+	d->desc.width = qoi_read_32(bytes, &p);
+	d->desc.height = qoi_read_32(bytes, &p);
+	d->desc.channels = bytes[p++];
+	d->desc.colorspace = bytes[p++];
+	if (d->desc.width == 0 || d->desc.height == 0
+	    || d->desc.channels < 3 || d->desc.channels > 4
+	    || d->desc.colorspace > 1
+	    || d->desc.height >= QOI_PIXELS_MAX / d->desc.width)
+		return 0;
+
+	d->channels = channels ? channels : d->desc.channels;
+	d->px[3] = 255;
+	return QOI_HEADER_SIZE;
+}
+
+size_t
+qoidec_pixels(struct qoidec *d, const void *data, size_t len,
+              void *out, size_t npx, size_t *written)
+{
+	const unsigned char *bytes = data;
+	unsigned char *o = out;
+	unsigned long total = (unsigned long)d->desc.width * d->desc.height;
+	unsigned char *px = d->px;
+	size_t p = 0, n;
+
+	if (npx > total - d->pos)
+		npx = total - d->pos;
+	for (n = 0; n < npx; n++) {
+		if (d->run > 0) {
+			d->run--;
+		} else {
+			int b1;
+			size_t need = 1;
+
+			if (p >= len)
+				break;
+			b1 = bytes[p];
+			if (b1 == QOI_OP_RGBA)
+				need = 5;
+			else if (b1 == QOI_OP_RGB)
+				need = 4;
+			else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA)
+				need = 2;
+			if (len - p < need)
+				break;
+			p++;
+
+			if (b1 == QOI_OP_RGB) {
+				px[0] = bytes[p++];
+				px[1] = bytes[p++];
+				px[2] = bytes[p++];
+			} else if (b1 == QOI_OP_RGBA) {
+				px[0] = bytes[p++];
+				px[1] = bytes[p++];
+				px[2] = bytes[p++];
+				px[3] = bytes[p++];
+			} else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+				memcpy(px, d->index[b1], 4);
+			} else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+				px[0] += ((b1 >> 4) & 0x03) - 2;
+				px[1] += ((b1 >> 2) & 0x03) - 2;
+				px[2] += ( b1       & 0x03) - 2;
+			} else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+				int b2 = bytes[p++];
+				int vg = (b1 & 0x3f) - 32;
+				px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+				px[1] += vg;
+				px[2] += vg - 8 +  (b2       & 0x0f);
+			} else if ((b1 & QOI_MASK_2) == QOI_OP_RUN) {
+				d->run = (b1 & 0x3f);
+			}
+
+			memcpy(d->index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+		}
+
+		memcpy(o, px, d->channels);
+		o += d->channels;
+	}
+
+	d->pos += n;
+	*written = n;
+	return p;
+}
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef QOIDEC_H__
+#define QOIDEC_H__
+
+#include <stddef.h>
+
+#include "qoi.h"
+
+/*
+ * Incremental QOI decoder, the encoded bytes can be fed in pieces and
+ * the pixels are written in as many pieces as wanted, wherever wanted.
+ */
+struct qoidec {
+	qoi_desc desc;
+	int channels; /* channels written to the output */
+	unsigned char index[64][4];
+	unsigned char px[4];
+	int run;
+	unsigned long pos; /* pixels decoded so far */
+};
+
+/* parse the header, returns its size or 0 when invalid */
+int qoidec_init(struct qoidec *d, const void *data, size_t len, int channels);
+
+/*
+ * Decode at most npx pixels to out, returns the number of bytes used
+ * from data and stores the number of pixels written in *written.
+ * Decoding stops before an op that is not complete in data.
+ */
+size_t qoidec_pixels(struct qoidec *d, const void *data, size_t len,
+                     void *out, size_t npx, size_t *written);
+
+#endif
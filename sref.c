@@ -4,18 +4,41 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <strings.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <locale.h>
 #include <ctype.h>
 #include <limits.h>
 #include <math.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#endif
+#include <time.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define HAVE_SSSE3 /* built for the CPUs which have it, see rgb_to_rgba */
+#endif
 
 #include <X11/Xlib.h>
 #include <X11/cursorfont.h>
 #include <X11/Xatom.h>
 #include <X11/extensions/Xrender.h>
 #include <X11/extensions/shape.h>
+#include <X11/extensions/XShm.h>
 #include <GL/glx.h>
 #undef GL_TIMEOUT_IGNORED
 #undef GL_INVALID_INDEX
@@ -23,6 +46,9 @@
 
 #include "stb_image.h"
 #include "qoi.h"
+#include "qoidec.h"
+#include "preview.h"
+#include "etc2.h"
 
 #include "arg.h"
 
@@ -44,6 +70,11 @@ struct shortcut {
 static void zoomreset(void);
 static void saveboard(void);
 static void toggleshape(void);
+static void paste(void);
+static void capture(void);
+static void undo(void);
+static void redo(void);
+static void arrange(void);
 
 #include "config.h"
 
@@ -53,22 +84,91 @@ static int mod_match(unsigned int mask, unsigned int state)
 }
 
 #define LEN(a) (sizeof(a)/sizeof(*a))
-struct image {
+
+/* a texture, shared by the images of identical content */
+struct texture {
 	GLuint id;
 	GLenum type;
+	GLenum format;
+	size_t width, height; /* size of the image it holds */
+	size_t texsize; /* video memory used */
+	int cached; /* can be read again from the cache */
+	int pyramid; /* comes from the pyramid */
+	int lodbias; /* pyramid levels skipped to save memory */
+	struct pyramid *pyr; /* mapped while set, the finer levels are paged */
+	int pyrbase; /* level of the pyramid held whole */
+	int pending; /* a job is on its way to set it */
+	int opening; /* not shown once yet */
+	int advised; /* its file is being read ahead */
+	int stream; /* read from a stream or a client, it has no file */
+	int frames; /* layers of an animation */
+	int *delays; /* of each frame, in milliseconds */
+	int frame; /* shown */
+	double next; /* time of the next frame */
+	int redraw; /* the frame changed */
+	unsigned long seen; /* last frame it was in view */
+	unsigned char *qoi; /* pixels once evicted */
+	size_t qoisize;
+	unsigned long uid; /* the loader jobs find it by uid */
+	uint64_t hash; /* of the file content */
+	char *path;
+	int refs;
+	unsigned long lender; /* its id is the one of this texture until set */
+	int lent; /* textures showing its id */
+};
+
+struct image {
+	struct texture *tex;
 	size_t width, height;
 	int posx;
 	int posy;
 	float scale;
+	float fit; /* shrunk to fit this square once its size is known */
 	const char *path;
+	double reloadat; /* its file changed, reloaded at this time */
+	int mark;
+	unsigned long id; /* on the control socket */
+	unsigned long key; /* in the session journal */
+	int sliding; /* from (fromx, fromy) to (tox, toy) once arranged */
+	int fromx, fromy, tox, toy;
 };
 static size_t image_count;
 static struct image images[MAX_IMAGE_COUNT];
+static struct texture textures[MAX_IMAGE_COUNT];
+static size_t texfree; /* no texture is free below */
 
 static struct image *hover_img;
 static struct image *focus_img;
+static unsigned long frameno;
+#define TILE_UPLOADS 16 /* pyramid tiles uploaded per frame */
+static int tileuploads; /* left in this frame */
+static int tilesleft; /* tiles in view wait for the next frame */
+static size_t texused, ramused;
+static GLuint evictfbo;
+
+/* budgets, lowered under memory pressure */
+static size_t texcap = SIZE_MAX, ramcap = SIZE_MAX;
+static int lodbias;
+static int pressure; /* 0 none, 1 some, 2 full */
+static double pressureend;
+static int psifd[2] = { -1, -1 };
 char *argv0;
 static char *session_file;
+static char *stream_file;
+static char *ctl_file;
+static int showstats;
+
+/* images being opened, timed since the first of them */
+static size_t openleft, opencount;
+static double openstart;
+
+/* upload timings, from client memory or from a pixel buffer */
+enum { UP_MEMORY, UP_PBO, UP_COUNT };
+static struct {
+	unsigned long count;
+	double mpx;
+	double secs;
+} upstats[UP_COUNT][6];
 
 static int orgx;
 static int orgy;
@@ -77,6 +177,8 @@ static int mousex;
 static int mousey;
 static int xrel;
 static int yrel;
+static float panvx, panvy; /* of the view, board pixels per second */
+static double panlast;
 static int lclick;
 static int mclick;
 static int rclick;
@@ -109,8 +211,29 @@ static char *dndtargetnames[] = {
 };
 static Atom dndtargetatoms[LEN(dndtargetnames)];
 static Atom dndtarget;
+static Window dndsrc; /* of the drop, until it is finished */
+static int dndx, dndy; /* last position of the drag on the root */
+#define DND_CHUNK 65536 /* of the URI list read at once */
+
+/* images pasted from the clipboard, by order of preference */
+static Atom clipboard, cliptargets, clipincr, clipprop;
+static char *cliptargetnames[] = {
+	"image/png",
+	"image/qoi",
+	"image/jpeg",
+	"image/gif",
+	"image/bmp",
+};
+static Atom cliptargetatoms[LEN(cliptargetnames)];
+static struct {
+	Atom target; /* requested */
+	int incr; /* the data comes by pieces */
+	unsigned char *data;
+	size_t len, cap;
+	int x, y; /* of the image on the board */
+} pasted;
 
-static Cursor movecursor, grabcursor, scalecursor, defaultcursor;
+static Cursor movecursor, grabcursor, scalecursor, defaultcursor, capturecursor;
 static GLXContext ctx;
 
 static GLuint quad_vao;
@@ -120,12 +243,42 @@ static GLint loc_res;
 static GLint loc_off;
 static GLint loc_ext;
 static GLint loc_img;
+static GLint loc_imgs;
+static GLint loc_layer;
+static GLuint boardfbo, boardrb;
+static unsigned int boardw, boardh;
+static GLint maxlayers;
+static int animfd = -1;
+
+/* draws are clipped to this rectangle, in GL coordinates */
+static struct {
+	int x0, y0, x1, y1;
+} clip;
 
 static char logbuf[4096];
 static GLsizei logsize;
 
-static void write_session(const char *name);
+static unsigned long write_session(const char *name);
 static void read_session(const char *name);
+static void journal_image(struct image *img, int kind);
+static void undo_begin(struct image *img);
+static void undo_push(struct image *img);
+static void journal_reset(void);
+static void journal_sync(void);
+static void ctl_saved(unsigned long serial, const char *name, int error);
+static void cache_init(void);
+static void loader_init(void);
+static void pressure_init(void);
+static void texture_restore(struct texture *t);
+static void anim_arm(void);
+static void anim_step(void);
+static void arrange_step(void);
+static void prefetch(void);
+static void render_tiles(struct image *i, int x, int y, int w, int h);
+static void texture_trim(void);
+#define CTL_CLIENTS 16 /* on the control socket at once */
+static void ctl_pollfds(struct pollfd *p);
+static int ctl_poll(const struct pollfd *p);
 
 static void
 die(const char *fmt, ...)
@@ -185,30 +338,17 @@ urldecode(char *str, char *url, size_t len)
 }
 
 static void load_at(const char *name, int x, int y, float scale);
-static void
-load(const char *name)
-{
-	load_at(name, 0, 0, 1.0);
-}
+static void load_file(const char *name, int x, int y, float scale);
 
-static struct image
-create_image(size_t w, size_t h, GLenum format, GLenum type, void *data)
+static void
+texture_params(GLenum type, GLenum format)
 {
-	struct image img = { 0 };
 	GLint rrr1[] = {GL_RED, GL_RED, GL_RED, GL_ONE};
 	GLint rrra[] = {GL_RED, GL_RED, GL_RED, GL_ALPHA};
 	GLint rgb1[] = {GL_RED, GL_GREEN, GL_BLUE, GL_ONE};
 	GLint rgba[] = {GL_RED, GL_GREEN, GL_BLUE, GL_ALPHA};
 	GLint *swiz = rrr1;
 
-	img.type = GL_TEXTURE_2D;
-	img.width = w;
-	img.height = h;
-	img.scale = 1;
-
-	glGenTextures(1, &img.id);
-	glBindTexture(img.type, img.id);
-
 	if (format == GL_RED)
 		swiz = rrr1;
 	else if (format == GL_RG)
@@ -218,12 +358,100 @@ create_image(size_t w, size_t h, GLenum format, GLenum type, void *data)
 	else if (format == GL_RGBA)
 		swiz = rgba;
 
-	glTexParameteriv(img.type, GL_TEXTURE_SWIZZLE_RGBA, swiz);
-	glTexParameteri(img.type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(img.type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(img.type, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(img.type, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexParameteriv(type, GL_TEXTURE_SWIZZLE_RGBA, swiz);
+	glTexParameteri(type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(type, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(type, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+}
+
+static int
+format_channels(GLenum format)
+{
+	if (format == GL_RG)
+		return 2;
+	else if (format == GL_RGB)
+		return 3;
+	else if (format == GL_RGBA)
+		return 4;
+	return 1;
+}
+
+/* largest unpack alignment the row stride allows */
+static GLint
+row_alignment(size_t stride)
+{
+	GLint a = 8;
+
+	while (stride % a)
+		a /= 2;
+	return a;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+upload_stat(int from, GLenum format, size_t px, double start)
+{
+	int n;
+
+	if (!showstats)
+		return;
+	/* the calls only queue the upload, wait for the transfer itself */
+	glFinish();
+	if (format == GL_COMPRESSED_RGB8_ETC2)
+		n = 4;
+	else if (format == GL_COMPRESSED_RGBA8_ETC2_EAC)
+		n = 5;
+	else
+		n = format_channels(format) - 1;
+	upstats[from][n].count++;
+	upstats[from][n].mpx += px / 1e6;
+	upstats[from][n].secs += now() - start;
+}
+
+static void
+upload_report(void)
+{
+	static const char *formats[] = {
+		"R8", "RG8", "RGB8", "RGBA8", "ETC2", "ETC2_EAC"
+	};
+	static const char *from[] = { "memory", "pbo" };
+	size_t i, n;
+
+	for (i = 0; i < UP_COUNT; i++) {
+		for (n = 0; n < LEN(formats); n++) {
+			if (upstats[i][n].count == 0)
+				continue;
+			err("upload %-8s %-6s %6lu uploads %9.1f Mpx %8.3f ms/Mpx\n",
+			    formats[n], from[i], upstats[i][n].count, upstats[i][n].mpx,
+			    upstats[i][n].mpx > 0 ? upstats[i][n].secs * 1e3 / upstats[i][n].mpx : 0);
+		}
+	}
+}
+
+static struct texture
+create_image(size_t w, size_t h, GLenum format, GLenum type, void *data)
+{
+	struct texture img = { 0 };
+
+	img.type = GL_TEXTURE_2D;
+	img.format = format;
+	img.width = w;
+	img.height = h;
+	img.texsize = w * h * (format == GL_RGB ? 4 : format_channels(format));
+
+	glGenTextures(1, &img.id);
+	glBindTexture(img.type, img.id);
+	texture_params(img.type, format);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, row_alignment(w * format_channels(format)));
 
 	/* for now input format is the same as the texture format */
 	glTexImage2D(img.type, 0, format, w, h, 0, format, type, data);
@@ -231,6 +459,33 @@ create_image(size_t w, size_t h, GLenum format, GLenum type, void *data)
 	return img;
 }
 
+/* the frames of an animation, one per layer */
+static struct texture
+create_image_array(size_t w, size_t h, int frames, void *data)
+{
+	struct texture img = { 0 };
+	double start;
+
+	img.type = GL_TEXTURE_2D_ARRAY;
+	img.format = GL_RGBA;
+	img.width = w;
+	img.height = h;
+	img.frames = frames;
+	img.texsize = w * h * 4 * frames;
+
+	glGenTextures(1, &img.id);
+	glBindTexture(img.type, img.id);
+	texture_params(img.type, img.format);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	start = now();
+	glTexImage3D(img.type, 0, img.format, w, h, frames, 0, img.format,
+		     GL_UNSIGNED_BYTE, data);
+	upload_stat(UP_MEMORY, img.format, w * h * frames, start);
+	glBindTexture(img.type, 0);
+
+	return img;
+}
+
 static void
 shader_init(void)
 {
@@ -257,11 +512,17 @@ shader_init(void)
 	const char *frag =
 		"#version 300 es\n"
 		"precision mediump float;\n"
+		"precision mediump sampler2DArray;\n"
 		"in vec2 tex;\n"
 		"out vec3 color;\n"
 		"uniform sampler2D img;\n"
+		"uniform sampler2DArray imgs;\n"
+		"uniform int layer;\n"
 		"void main() {\n"
-		"	color = texture(img, tex).rgb;\n"
+		"	if (layer < 0)\n"
+		"		color = texture(img, tex).rgb;\n"
+		"	else\n"
+		"		color = texture(imgs, vec3(tex, float(layer))).rgb;\n"
 		"}\n";
 	GLint vert_size = strlen(vert);
 	GLint frag_size = strlen(frag);
@@ -311,6 +572,8 @@ shader_init(void)
 	loc_off = glGetUniformLocation(sprg, "off");
 	loc_ext = glGetUniformLocation(sprg, "ext");
 	loc_img = glGetUniformLocation(sprg, "img");
+	loc_imgs = glGetUniformLocation(sprg, "imgs");
+	loc_layer = glGetUniformLocation(sprg, "layer");
 
 	glGenVertexArrays(1, &quad_vao);
 	glBindVertexArray(quad_vao);
@@ -353,6 +616,14 @@ img_to_rect(struct image *i, int px)
 	return r;
 }
 
+/* from window to board coordinates */
+static void
+win_to_board(int *x, int *y)
+{
+	*x = (*x - (int)width / 2) / zoom - orgx;
+	*y = (*y - (int)height / 2) / zoom - orgy;
+}
+
 static int
 mouse_in(int x, int y, int w, int h)
 {
@@ -373,6 +644,19 @@ mouse_in_img(struct image *i)
 	return mouse_in_rect(img_to_rect(i, 0));
 }
 
+/* same as img_to_rect but without the overflow of far away images */
+static int
+img_in_view(struct image *i)
+{
+	float z = zoom;
+	float x = z * (i->posx + orgx) + width / 2;
+	float y = z * (i->posy + orgy) + height / 2;
+	float w = z * (i->width * i->scale);
+	float h = z * (i->height * i->scale);
+
+	return x + w >= 0 && y + h >= 0 && x < width && y < height;
+}
+
 static void
 scissor(int x, int y, int w, int h, int px)
 {
@@ -384,7 +668,13 @@ scissor(int x, int y, int w, int h, int px)
 		y -= px;
 		h += px;
 	}
-	glScissor(x, y, w + px, h + px);
+	w += x + px;
+	h += y + px;
+	x = x > clip.x0 ? x : clip.x0;
+	y = y > clip.y0 ? y : clip.y0;
+	w = (w < clip.x1 ? w : clip.x1) - x;
+	h = (h < clip.y1 ? h : clip.y1) - y;
+	glScissor(x, y, w > 0 ? w : 0, h > 0 ? h : 0);
 }
 
 static void
@@ -396,6 +686,8 @@ render_img(struct image *i)
 	int w = r.width;
 	int h = r.height;
 
+	if (!i->tex->id)
+		return; /* still loading */
 	if (i == focus_img)
 		glClearColor(focus.r, focus.g, focus.b, 1.0);
 	else if (i == hover_img)
@@ -408,19 +700,69 @@ render_img(struct image *i)
 
 	glUniform2f(loc_off, x, y);
 	glUniform2f(loc_ext, w, h);
-	glBindTexture(i->type, i->id);
+	if (i->tex->type == GL_TEXTURE_2D_ARRAY) {
+		glActiveTexture(GL_TEXTURE0 + 1);
+		glBindTexture(i->tex->type, i->tex->id);
+		glActiveTexture(GL_TEXTURE0 + 0);
+		glUniform1i(loc_layer, i->tex->frame);
+	} else {
+		glBindTexture(i->tex->type, i->tex->id);
+		glUniform1i(loc_layer, -1);
+	}
 
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	if (i->tex->pyr)
+		render_tiles(i, x, y, w, h);
 }
 
+/*
+ * The board is drawn in a framebuffer kept between frames, so that an
+ * animation draws again its own rectangle only.
+ */
 static void
-update(void)
+board_bind(void)
 {
-	size_t i;
+	if (boardw != width || boardh != height) {
+		if (!boardfbo) {
+			glGenFramebuffers(1, &boardfbo);
+			glGenRenderbuffers(1, &boardrb);
+		}
+		glBindRenderbuffer(GL_RENDERBUFFER, boardrb);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width ? width : 1, height ? height : 1);
+		glBindFramebuffer(GL_FRAMEBUFFER, boardfbo);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+					  GL_RENDERBUFFER, boardrb);
+		boardw = width;
+		boardh = height;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, boardfbo);
+}
+
+static void
+board_show(void)
+{
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, boardfbo);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	glDisable(GL_SCISSOR_TEST);
+	glBlitFramebuffer(0, 0, width, height, 0, 0, width, height,
+			  GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glXSwapBuffers(dpy, win);
+}
+
+/* start drawing the board within a rectangle, in GL coordinates */
+static void
+draw_begin(int x0, int y0, int x1, int y1)
+{
+	board_bind();
+	clip.x0 = x0 > 0 ? x0 : 0;
+	clip.y0 = y0 > 0 ? y0 : 0;
+	clip.x1 = x1 < (int)width ? x1 : (int)width;
+	clip.y1 = y1 < (int)height ? y1 : (int)height;
 
 	glEnable(GL_SCISSOR_TEST);
 	glViewport(0, 0, width, height);
-	glScissor(0, 0, width, height);
+	scissor(clip.x0, clip.y0, clip.x1 - clip.x0, clip.y1 - clip.y0, 0);
 	glClearColor(bg.r, bg.g, bg.b, bg_alpha);
 	glClear(GL_COLOR_BUFFER_BIT);
 
@@ -428,18 +770,43 @@ update(void)
 	glBindVertexArray(quad_vao);
 	glActiveTexture(GL_TEXTURE0 + 0);
 	glUniform1i(loc_img, 0);
+	glUniform1i(loc_imgs, 1);
 	glUniform2f(loc_res, width, height);
+}
+
+static void
+update(void)
+{
+	size_t i, n;
+
+	draw_begin(0, 0, width, height);
+
+	frameno++;
+	tileuploads = TILE_UPLOADS;
+	tilesleft = 0;
+	for (i = 0; i < image_count; i++) {
+		struct texture *t = images[i].tex;
+
+		if (!img_in_view(&images[i]))
+			continue;
+		t->seen = frameno;
+		if (!t->id && t->width && !t->pending)
+			texture_restore(t);
+	}
+	prefetch();
+	anim_step();
+	arrange_step();
 
 	hover_img = NULL;
 	if (act == NONE)
 		focus_img = NULL;
 	for (i = 0; i < image_count; i++) {
-		if (mouse_in_img(&images[i])) {
+		if (images[i].tex->id && mouse_in_img(&images[i])) {
 			hover_img = &images[i];
 		}
 	}
-	if (act != NONE && focus_img == NULL)
-		focus_img = hover_img;
+	if (act != NONE && focus_img == NULL && (focus_img = hover_img))
+		undo_begin(focus_img);
 	if (focus_img) {
 		switch (act) {
 		case MOVE:
@@ -458,19 +825,124 @@ update(void)
 
 	for (i = 0; i < image_count; i++)
 		render_img(&images[i]);
+	texture_trim();
 
-	if (!customshape || focus_img || image_count == 0) {
+	for (n = 0, i = 0; i < image_count; i++)
+		if (images[i].tex->id)
+			rect[n++] = img_to_rect(&images[i], borderpx);
+	if (!customshape || focus_img || n == 0) {
 		XRectangle r = win_rect();
 		XShapeCombineRectangles(dpy, win, ShapeBounding,
 				0, 0, &r, 1, ShapeSet, 0);
 	} else {
-		for (i = 0; i < image_count; i++)
-			rect[i] = img_to_rect(&images[i], borderpx);
 		XShapeCombineRectangles(dpy, win, ShapeBounding,
-				0, 0, rect, image_count, ShapeSet, 0);
+				0, 0, rect, n, ShapeSet, 0);
 	}
 
-	glXSwapBuffers(dpy, win);
+	board_show();
+	anim_arm();
+}
+
+/* delay of the current frame of an animation */
+static double
+frame_delay(struct texture *t)
+{
+	int ms = t->delays ? t->delays[t->frame] : 0;
+
+	/* like the browsers, too short delays are slowed down */
+	return (ms < 20 ? 100 : ms) / 1000.0;
+}
+
+/* returns the time of the next frame of the animations in view, 0 if none */
+static double
+anim_next(void)
+{
+	double at = 0;
+	size_t i;
+
+	for (i = 0; i < LEN(textures); i++) {
+		struct texture *t = &textures[i];
+		if (t->frames > 1 && t->id && t->seen == frameno && (!at || t->next < at))
+			at = t->next;
+	}
+	return at;
+}
+
+static void
+anim_arm(void)
+{
+#ifdef __linux__
+	struct itimerspec its = { 0 };
+	double at = anim_next();
+
+	if (animfd < 0)
+		return;
+	if (at > 0) {
+		its.it_value.tv_sec = at;
+		its.it_value.tv_nsec = (at - its.it_value.tv_sec) * 1e9 + 1;
+	}
+	timerfd_settime(animfd, TFD_TIMER_ABSTIME, &its, NULL);
+#endif
+}
+
+static void
+anim_init(void)
+{
+#ifdef __linux__
+	animfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+#endif
+}
+
+/* move the animations in view to their current frame */
+static void
+anim_step(void)
+{
+	double t = now();
+	struct texture *a;
+	size_t i;
+
+	for (i = 0; i < LEN(textures); i++) {
+		a = &textures[i];
+		a->redraw = 0;
+		if (a->frames < 2 || !a->id || a->seen != frameno)
+			continue;
+		if (a->next < t - 1)
+			a->next = t; /* paused while out of view */
+		while (a->next <= t) {
+			a->frame = (a->frame + 1) % a->frames;
+			a->next += frame_delay(a);
+			a->redraw = 1;
+		}
+	}
+}
+
+/* show the next frames of the animations in view, only they are drawn */
+static void
+anim_update(void)
+{
+	XRectangle r, q;
+	size_t i, j;
+	int y, drawn = 0;
+
+	anim_step();
+	for (i = 0; i < image_count; i++) {
+		if (!images[i].tex->redraw)
+			continue;
+		r = img_to_rect(&images[i], borderpx);
+		y = height - r.y - r.height;
+		draw_begin(r.x, y, r.x + r.width, y + r.height);
+		/* with the images over and under it */
+		for (j = 0; j < image_count; j++) {
+			q = img_to_rect(&images[j], borderpx);
+			if (q.x < r.x + r.width && r.x < q.x + q.width
+			    && q.y < r.y + r.height && r.y < q.y + q.height)
+				render_img(&images[j]);
+		}
+		drawn = 1;
+	}
+	if (drawn)
+		board_show();
+	anim_arm();
 }
 
 static int
@@ -553,7 +1025,8 @@ glx_init(void)
 	wa.colormap = map = XCreateColormap(dpy, root, vis->visual, AllocNone);
 	wa.event_mask = ExposureMask | VisibilityChangeMask
 		| FocusChangeMask | KeyPressMask | StructureNotifyMask
-		| PointerMotionMask | ButtonPressMask | ButtonReleaseMask;
+		| PointerMotionMask | ButtonPressMask | ButtonReleaseMask
+		| PropertyChangeMask;
 	win = XCreateWindow(dpy, root, 0, 0, width, height, 0,
 			    vis->depth, InputOutput, vis->visual,
 			    CWBackPixel | CWBorderPixel | CWColormap | CWEventMask, &wa);
@@ -606,6 +1079,12 @@ xdnd_init(void)
 
 	XInternAtoms(dpy, dndtargetnames, LEN(dndtargetnames), False, dndtargetatoms);
 
+	clipboard = XInternAtom(dpy, "CLIPBOARD", False);
+	cliptargets = XInternAtom(dpy, "TARGETS", False);
+	clipincr = XInternAtom(dpy, "INCR", False);
+	clipprop = XInternAtom(dpy, "SREF_CLIP", False);
+	XInternAtoms(dpy, cliptargetnames, LEN(cliptargetnames), False, cliptargetatoms);
+
 	XChangeProperty(dpy, win, xdndaware, XA_ATOM, 32, PropModeReplace, &dndversion, 1);
 }
 
@@ -627,6 +1106,7 @@ x_init(void)
 	grabcursor = XCreateFontCursor(dpy, XC_hand1);
 	scalecursor = XCreateFontCursor(dpy, XC_sizing);
 	defaultcursor = XCreateFontCursor(dpy, XC_arrow);
+	capturecursor = XCreateFontCursor(dpy, XC_crosshair);
 
 	XStoreName(dpy, win, "sref");
 
@@ -641,6 +1121,10 @@ init(void)
 {
 	x_init();
 	shader_init();
+	cache_init();
+	loader_init();
+	pressure_init();
+	anim_init();
 }
 
 static void *
@@ -648,24 +1132,32 @@ file_read(const char *name, size_t *s)
 {
 	char *data = NULL, *newp;
 	size_t len, size;
-	int n;
+	struct stat st;
+	ssize_t n;
 	int fd;
 
-	fd = open(name, O_RDONLY);
+	fd = open(name, O_RDONLY | O_CLOEXEC);
 	if (fd < 0)
 		return NULL;
 
-	len = size = 0;
-	do {
-		newp = realloc(data, size += 4096);
-		if (!newp)
-			goto free;
-		data = newp;
-		n = read(fd, &data[len], 4096);
+	/* a single read when the size is known */
+	len = 0;
+	size = fstat(fd, &st) == 0 && st.st_size > 0 ? (size_t)st.st_size + 1 : 4096;
+	if (!(data = malloc(size)))
+		goto free;
+	while ((n = read(fd, &data[len], size - len)) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
 		if (n < 0)
 			goto free;
 		len += n;
-	} while (n == 4096);
+		if (len == size) {
+			newp = realloc(data, size *= 2);
+			if (!newp)
+				goto free;
+			data = newp;
+		}
+	}
 	close(fd);
 
 	*s = len;
@@ -676,489 +1168,6321 @@ free:
 	return NULL;
 }
 
-static void
-load_at(const char *name, int x, int y, float scale)
-{
-	GLenum format;
-	int w, h, n;
-	unsigned char *file;
+/*
+ * Pyramid cache, a deep-zoom copy of large images stored in the cache
+ * directory.  The file is made of a header, one descriptor per level,
+ * an index with the offset of every tile, followed by the tiles.  All
+ * tiles are tilesize x tilesize pixels, the ones on the right and
+ * bottom edges are padded.  Level n is the level n-1 halved, down to
+ * the first level that fits in a single tile.
+ */
+#define PYR_MAGIC "srefpyr2"
+#define PYR_MAX_LEVELS 32
+#define PYR_OVERVIEW 2048 /* largest level held whole in a texture */
+
+struct pyr_header {
+	char magic[8];
+	uint32_t width, height;
+	uint32_t channels;
+	uint32_t tilesize;
+	uint32_t levels;
+	uint32_t pad;
+	uint64_t srcsize;
+	int64_t srcmtime;
+	uint64_t hash; /* of the source file */
+};
+
+struct pyr_level {
+	uint32_t width, height;
+	uint32_t tilesx, tilesy;
+	uint64_t index; /* first tile of the level in the offset index */
+};
+
+struct pyramid {
+	unsigned char *map;
+	size_t size;
+	const struct pyr_header *hdr;
+	const struct pyr_level *lvl;
+	const uint64_t *index;
+};
+
+/*
+ * ETC2 cache, the image compressed by the etc2 encoder, a header
+ * followed by the blocks ready to be uploaded.
+ */
+#define ETC_MAGIC "srefetc2"
+
+struct etc_header {
+	char magic[8];
+	uint32_t width, height;
+	uint32_t format; /* compressed internal format */
+	uint32_t pad;
+	uint64_t size; /* size of the blocks */
+	uint64_t srcsize;
+	int64_t srcmtime;
+	uint64_t hash; /* of the source file */
+};
+
+struct etc {
+	unsigned char *map;
+	size_t size;
+	const struct etc_header *hdr;
+};
+
+/*
+ * Session journal, the changes of the board are appended to the journal
+ * next to the session file and replayed over the session file when it
+ * is read, so a crash loses none of them.  The journal starts with the
+ * identity of the session file it goes with, a journal left from another
+ * session file is ignored.  The records name the images by key, their
+ * rank in the session file, or a number past the last rank for the images
+ * added since.  Once the journal is over journalbytes, the session file is
+ * written again in the background and the journal starts over.  The
+ * images found under a directory line of the session file have no key,
+ * the line brings them back; once found, the session file is written
+ * again with them in its place.
+ */
+#define JNL_MAGIC "srefjnl1"
+
+enum { JNL_ADD = 1, JNL_MOVE, JNL_REMOVE };
+
+struct jnl_header {
+	char magic[8];
+	uint64_t ino, size; /* of the session file */
+	int64_t mtime;
+};
+
+struct jnl_record {
+	uint16_t kind;
+	uint16_t len; /* of the path following an add */
+	uint32_t key;
+	int32_t x, y; /* of the center */
+	float scale;
+};
+
+static struct {
+	int fd;
+	char *path;
+	size_t size;
+	double syncat; /* the records written are flushed at this time */
+	unsigned long compacting; /* save of the session file being written */
+	unsigned long last; /* save of the session file started last */
+	uint32_t *keys; /* of the images in the save */
+	size_t nkeys;
+	unsigned long snaplast; /* last key when saved */
+	char *tail; /* records written since the save */
+	size_t tailsize, tailcap;
+	size_t compactat; /* size to compact the journal at */
+} journal = { .fd = -1 };
+static unsigned long lastkey;
+static int keyless; /* the images added are not journaled */
+static unsigned int savesbusy; /* saves being written */
+
+/*
+ * Images are read and decoded by the worker threads, jobs go back and
+ * forth between the todo queue, handled by the workers, and the done
+ * queue, handled by the main thread which owns the GL context.
+ */
+enum job_kind {
+	JOB_LOAD,	/* worker: read and decode the file */
+	JOB_READ,	/* reader: read the file for the workers */
+	JOB_DECODE,	/* worker: decode into the mapped buffer */
+	JOB_PYRAMID,	/* worker: write the pyramid cache */
+	JOB_COMPRESS,	/* worker: write the etc2 cache */
+	JOB_EVICT,	/* worker: compress an evicted texture */
+	JOB_SCAN,	/* worker: list the images of a directory */
+	JOB_DROP,	/* worker: sort the files dropped from the directories */
+	JOB_ADVISE,	/* worker: have the file read ahead */
+	JOB_MAP,	/* main: map a pixel buffer to decode into */
+	JOB_UPLOAD,	/* main: upload the pixel buffer */
+	JOB_PREVIEW,	/* main: upload an early pass */
+	JOB_IMAGE,	/* main: upload the decoded image */
+	JOB_ANIM,	/* main: upload the frames of an animation */
+	JOB_TILES,	/* main: upload the pyramid */
+	JOB_ETC,	/* main: upload the compressed image */
+	JOB_BAND,	/* main: upload a band of rows */
+	JOB_STORE,	/* main: keep the compressed evicted texture */
+	JOB_SHARE,	/* main: use the texture of the same content */
+	JOB_FOUND,	/* main: load the images of a directory */
+	JOB_SESSION,	/* worker: write the session file under a temporary name */
+	JOB_SYNC,	/* worker: flush the session journal to the disk */
+	JOB_SAVED,	/* main: put the session file in place */
+	JOB_DONE,	/* main: nothing left to upload */
+	JOB_FAIL,	/* main: drop the image */
+};
+
+/* directories opened at once are laid out on a single grid */
+struct import {
+	int x, y; /* center of the first cell */
+	size_t count; /* images laid out */
+	int scans; /* directories left to scan */
+	int session; /* a line of the session file */
+};
+
+struct job {
+	struct job *next;
+	enum job_kind kind;
+	unsigned long uid; /* of the texture */
+	uint64_t hash; /* of the file */
+	unsigned long shareuid; /* texture of the same hash */
+	char *name;
+	char *target; /* file a save replaces, its links resolved */
+	struct stat st;
+	int cached;
+	char path[PATH_MAX]; /* pyramid cache file */
+	char etcpath[PATH_MAX]; /* etc2 cache file */
+	struct pyramid pyr;
+	struct etc etc;
 	unsigned char *data;
+	int width, height; /* size of the image */
+	int pw, ph, channels; /* size of data */
+	int y; /* first row of a band */
+	int qoif;
+	unsigned char *file;
 	size_t len;
-	int type_qoif = 0;
+	int fd; /* file being read by the reader */
+	int reload; /* of an image whose file changed */
+	int stream; /* frame of a stream, never shared */
+	int frames; /* of an animation, one after the other in data */
+	int *delays;
+	GLuint pbo;
+	size_t pbosize;
+	unsigned char *dst; /* mapping of pbo */
+	struct job *parent; /* job decoding the bands */
+	int inflight; /* bands not yet uploaded */
+	struct import *import;
+	char **names; /* images found by a scan */
+	size_t count;
+	int error; /* of the session write */
+	int nopbo; /* its mapped buffer was lost, decoded in memory */
+	GLsync sync; /* read back in pbo once signaled */
+};
 
-	if (name == NULL)
-		return;
+struct queue {
+	struct job *head, *tail;
+};
 
-	if (image_count >= LEN(images)) {
-		err("%s: Cannot open image, too many open\n", name);
-		return;
-	}
+static void job_session(struct job *job);
+static void session_saved(struct job *job);
 
-	file = file_read(name, &len);
-	if (file == NULL || len == 0) {
-		err("%s: Fail to load image\n", name);
-		if (file)
-			free(file);
-		return;
-	}
+/* bands decoded ahead of the upload */
+#define BANDS_INFLIGHT 4
 
-	if (len > 22 && strncmp((char *)file, "qoif", strlen("qoif")) == 0) {
-		qoi_desc desc;
-		type_qoif = 1;
-		data = qoi_decode(file, len, &desc, 0);
-		w = desc.width;
-		h = desc.height;
-		n = desc.channels;
-	} else {
-		data = stbi_load_from_memory(file, len, &w, &h, &n, 0);
-	}
-	free(file);
-	if (data == NULL || n == 0) {
-		err("%s: Fail to load image\n", name);
-		return;
-	}
+/* pixel unpack buffers kept for reuse */
+#define PBO_POOL 4
+static struct {
+	GLuint id;
+	size_t size;
+} pbopool[PBO_POOL];
+static size_t pbocount;
+
+/* up to PBO_MAPPED times pbobytes mapped at once, the other jobs wait */
+#define PBO_MAPPED 4
+static size_t pbomapped;
+static struct queue pbowait;
+
+/* evicted textures being read back, in the order of their fences */
+static struct queue readbacks;
+
+static pthread_mutex_t loadlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loadcond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t bandcond = PTHREAD_COND_INITIALIZER;
+static struct queue todo, done;
+
+/*
+ * Texture of each content hash, shared with the workers.  A texture freed
+ * while its load is in flight leaves a gone entry, so that its job does
+ * not publish the hash of a texture that is no more.
+ */
+static struct {
+	uint64_t hash;
+	unsigned long uid;
+	int gone;
+} hashes[MAX_IMAGE_COUNT];
+static size_t hashcount;
+static int wakefd[2] = { -1, -1 };
+static GLint maxtexsize;
+
+static char cachedir[PATH_MAX];
 
-	if (n == 1)
-		format = GL_RED;
-	else if (n == 2)
-		format = GL_RG;
-	else if (n == 3)
-		format = GL_RGB;
-	else if (n == 4)
-		format = GL_RGBA;
-	else
-		format = GL_RED;
+static void
+cache_init(void)
+{
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	char *p;
+	int n;
 
-	images[image_count] = create_image(w, h, format, GL_UNSIGNED_BYTE, data);
-	images[image_count].path = strdup(name);
-	images[image_count].scale = scale;
-	images[image_count].posx = x - w / 2;
-	images[image_count].posy = y - h / 2;
-	image_count++;
+	if (pyramidpixels == 0 && etc2quality < 0)
+		return;
+	if (xdg && *xdg)
+		n = snprintf(cachedir, sizeof(cachedir), "%s/sref", xdg);
+	else if (home && *home)
+		n = snprintf(cachedir, sizeof(cachedir), "%s/.cache/sref", home);
+	else
+		n = -1;
+	if (n < 0 || (size_t)n >= sizeof(cachedir))
+		goto disable;
 
-	if (type_qoif) {
-		free(data);
-	} else {
-		stbi_image_free(data);
+	/* mkdir -p */
+	for (p = cachedir + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(cachedir, 0755) < 0 && errno != EEXIST) {
+			*p = '/';
+			goto disable;
+		}
+		*p = '/';
 	}
+	if (mkdir(cachedir, 0755) < 0 && errno != EEXIST)
+		goto disable;
+	return;
+disable:
+	err("%s: cache disabled: %s\n", cachedir, strerror(errno));
+	cachedir[0] = '\0';
 }
 
-static void
-resize(int w, int h)
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+
+static uint64_t
+fnv1a(uint64_t h, const void *data, size_t len)
 {
-	width  = (w < 0) ? 0 : w;
-	height = (h < 0) ? 0 : h;
+	const unsigned char *p = data;
+
+	while (len--)
+		h = (h ^ *p++) * 0x100000001b3ULL;
+	return h;
 }
 
-static void
-zoomreset(void)
+static int64_t
+stat_mtime(const struct stat *st)
 {
-	zoom = 1;
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
 }
 
-static void
-saveboard(void)
+static int
+cache_path(char *out, size_t size, const char *name, const struct stat *st, const char *ext)
 {
-	write_session(session_file);
+	char real[PATH_MAX];
+	uint64_t h = FNV_OFFSET;
+	uint64_t v;
+	int n;
+
+	if (cachedir[0] == '\0' || !realpath(name, real))
+		return -1;
+	h = fnv1a(h, real, strlen(real));
+	v = st->st_size;
+	h = fnv1a(h, &v, sizeof(v));
+	v = stat_mtime(st);
+	h = fnv1a(h, &v, sizeof(v));
+
+	n = snprintf(out, size, "%s/%016llx.%s", cachedir, (unsigned long long)h, ext);
+	return (n < 0 || (size_t)n >= size) ? -1 : 0;
 }
 
 static void
-toggleshape(void)
+downsample(unsigned char *dst, const unsigned char *src, size_t w, size_t h, int n)
 {
-	customshape = !customshape;
+	size_t dw = w > 1 ? w / 2 : 1;
+	size_t dh = h > 1 ? h / 2 : 1;
+	size_t x, y, x0, x1, y0, y1;
+	const unsigned char *r0, *r1;
+	int c;
+
+	for (y = 0; y < dh; y++) {
+		y0 = 2 * y < h ? 2 * y : h - 1;
+		y1 = y0 + 1 < h ? y0 + 1 : y0;
+		r0 = src + y0 * w * n;
+		r1 = src + y1 * w * n;
+		for (x = 0; x < dw; x++) {
+			x0 = 2 * x < w ? 2 * x : w - 1;
+			x1 = x0 + 1 < w ? x0 + 1 : x0;
+			for (c = 0; c < n; c++) {
+				unsigned int s = r0[x0 * n + c] + r0[x1 * n + c]
+					       + r1[x0 * n + c] + r1[x1 * n + c];
+				*dst++ = (s + 2) / 4;
+			}
+		}
+	}
 }
 
-static void *
-xgetprop(Window w, Atom prop, Atom *type, int *fmt, size_t *cnt)
+static int
+pyramid_write(FILE *f, struct job *job)
 {
-	unsigned long rem;
-	void *ret = NULL;
-	int r, size = 0;
-
-	*type = None;
-	*cnt = 0;
-	do {
-		if (ret != NULL)
-			XFree(ret);
-		r = XGetWindowProperty(dpy, w, prop, 0, size, False, AnyPropertyType,
-				   type, fmt, cnt, &rem, (void *)&ret);
-		if (r != Success)
+	struct pyr_header hdr = { 0 };
+	struct pyr_level lvl[PYR_MAX_LEVELS];
+	unsigned char *level, *next, *tile;
+	size_t ts = pyramidtile;
+	size_t n = job->channels;
+	size_t tilebytes = ts * ts * n;
+	size_t w, h, l, t, y, ntiles = 0;
+	uint64_t off;
+	int ret = -1;
+
+	memcpy(hdr.magic, PYR_MAGIC, sizeof(hdr.magic));
+	hdr.width = job->width;
+	hdr.height = job->height;
+	hdr.channels = n;
+	hdr.tilesize = ts;
+	hdr.srcsize = job->st.st_size;
+	hdr.srcmtime = stat_mtime(&job->st);
+	hdr.hash = job->hash;
+
+	w = job->width;
+	h = job->height;
+	for (l = 0; l < PYR_MAX_LEVELS; l++) {
+		lvl[l].width = w;
+		lvl[l].height = h;
+		lvl[l].tilesx = (w + ts - 1) / ts;
+		lvl[l].tilesy = (h + ts - 1) / ts;
+		lvl[l].index = ntiles;
+		ntiles += lvl[l].tilesx * lvl[l].tilesy;
+		if (w <= ts && h <= ts)
+			break;
+		w = w > 1 ? w / 2 : 1;
+		h = h > 1 ? h / 2 : 1;
+	}
+	hdr.levels = l < PYR_MAX_LEVELS ? l + 1 : PYR_MAX_LEVELS;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		return -1;
+	if (fwrite(lvl, sizeof(*lvl), hdr.levels, f) != hdr.levels)
+		return -1;
+	off = sizeof(hdr) + hdr.levels * sizeof(*lvl) + ntiles * sizeof(off);
+	for (t = 0; t < ntiles; t++, off += tilebytes)
+		if (fwrite(&off, sizeof(off), 1, f) != 1)
+			return -1;
+
+	tile = malloc(tilebytes);
+	level = job->data;
+	next = NULL;
+	if (!tile)
+		return -1;
+	for (l = 0; l < hdr.levels; l++) {
+		w = lvl[l].width;
+		h = lvl[l].height;
+		for (t = 0; t < (size_t)lvl[l].tilesx * lvl[l].tilesy; t++) {
+			size_t tx = (t % lvl[l].tilesx) * ts;
+			size_t ty = (t / lvl[l].tilesx) * ts;
+			size_t tw = w - tx < ts ? w - tx : ts;
+
+			memset(tile, 0, tilebytes);
+			for (y = 0; y < ts && ty + y < h; y++)
+				memcpy(tile + y * ts * n, level + ((ty + y) * w + tx) * n, tw * n);
+			if (fwrite(tile, tilebytes, 1, f) != 1)
+				goto out;
+		}
+		if (l + 1 == hdr.levels)
 			break;
+		next = malloc((size_t)lvl[l + 1].width * lvl[l + 1].height * n);
+		if (!next)
+			goto out;
+		downsample(next, level, w, h, n);
+		if (level != job->data)
+			free(level);
+		level = next;
+	}
+	ret = 0;
+out:
+	if (level != job->data)
+		free(level);
+	free(tile);
+	return ret;
+}
 
-		size += rem;
-	} while (rem != 0);
+/* write a cache file under a temporary name, renamed once complete */
+static int
+cache_write(const char *path, int (*write)(FILE *, struct job *), struct job *job)
+{
+	static unsigned long serial;
+	char tmp[PATH_MAX + 48];
+	unsigned long n;
+	FILE *f;
+	int ret;
 
+	/* the workers may write caches at once */
+	pthread_mutex_lock(&loadlock);
+	n = ++serial;
+	pthread_mutex_unlock(&loadlock);
+	snprintf(tmp, sizeof(tmp), "%s.%ld.%lu", path, (long)getpid(), n);
+	f = fopen(tmp, "w");
+	if (!f)
+		return -1;
+	ret = write(f, job);
+	/* complete on the disk before it is in place */
+	if (fflush(f) != 0 || fsync(fileno(f)) < 0)
+		ret = -1;
+	if (fclose(f) != 0)
+		ret = -1;
+	if (ret == 0 && rename(tmp, path) < 0)
+		ret = -1;
+	if (ret < 0) {
+		err("%s: cannot write cache: %s\n", path, strerror(errno));
+		unlink(tmp);
+	}
 	return ret;
 }
 
-static Atom
-dndmatchtarget(size_t count, Atom *target)
+/* map a cache file of at least min bytes */
+static unsigned char *
+cache_map(const char *path, size_t min, size_t *size)
 {
-	size_t t, i;
+	unsigned char *map;
+	struct stat st;
+	int fd;
 
-	for (t = 0; t < LEN(dndtargetatoms); t++)
-		for (i = 0; i < count; i++)
-			if (target[i] != None && target[i] == dndtargetatoms[t])
-				return target[i];
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < min) {
+		close(fd);
+		return NULL;
+	}
+	*size = st.st_size;
+	map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return map == MAP_FAILED ? NULL : map;
+}
 
-	return None;
+static int
+pyramid_build(struct job *job)
+{
+	return cache_write(job->path, pyramid_write, job);
 }
 
 static void
-xev_visnotify(XEvent *ev)
+pyramid_close(struct pyramid *p)
 {
-	if (ev->xvisibility.state != VisibilityUnobscured)
-		XRaiseWindow(dpy, win);
+	if (p->map)
+		munmap(p->map, p->size);
+	memset(p, 0, sizeof(*p));
+}
+
+static int
+pyramid_open(struct pyramid *p, const char *path, const struct stat *st)
+{
+	const struct pyr_header *hdr;
+	size_t ts, tilebytes, ntiles, start, l, t;
+	uint64_t w, h;
+
+	memset(p, 0, sizeof(*p));
+	p->map = cache_map(path, sizeof(*hdr), &p->size);
+	if (!p->map)
+		return -1;
+
+	/* validate everything once, tiles can then be used blindly */
+	hdr = p->hdr = (void *)p->map;
+	if (memcmp(hdr->magic, PYR_MAGIC, sizeof(hdr->magic)) != 0
+	    || hdr->srcsize != (uint64_t)st->st_size
+	    || hdr->srcmtime != stat_mtime(st)
+	    || hdr->channels < 1 || hdr->channels > 4
+	    || hdr->tilesize < 1 || hdr->tilesize > 8192
+	    || hdr->levels < 1 || hdr->levels > PYR_MAX_LEVELS
+	    || hdr->width < 1 || hdr->height < 1)
+		goto bad;
+	ts = hdr->tilesize;
+	tilebytes = ts * ts * hdr->channels;
+	start = sizeof(*hdr) + hdr->levels * sizeof(*p->lvl);
+	if (start > p->size)
+		goto bad;
+	p->lvl = (void *)(p->map + sizeof(*hdr));
+	p->index = (void *)(p->map + start);
+
+	w = hdr->width;
+	h = hdr->height;
+	ntiles = 0;
+	for (l = 0; l < hdr->levels; l++) {
+		const struct pyr_level *lvl = &p->lvl[l];
+		if (lvl->width != w || lvl->height != h
+		    || lvl->tilesx != (w + ts - 1) / ts
+		    || lvl->tilesy != (h + ts - 1) / ts
+		    || lvl->index != ntiles)
+			goto bad;
+		ntiles += (size_t)lvl->tilesx * lvl->tilesy;
+		w = w > 1 ? w / 2 : 1;
+		h = h > 1 ? h / 2 : 1;
+	}
+	if (start + ntiles * sizeof(*p->index) > p->size)
+		goto bad;
+	for (t = 0; t < ntiles; t++)
+		if (p->index[t] > p->size || p->size - p->index[t] < tilebytes)
+			goto bad;
+
+	return 0;
+bad:
+	pyramid_close(p);
+	return -1;
+}
+
+static int
+etc_write(FILE *f, struct job *job)
+{
+	struct etc_header hdr = { 0 };
+	unsigned char *blocks;
+	size_t npx = (size_t)job->width * job->height;
+	int alpha = etc2_has_alpha(job->data, npx, job->channels);
+	int ret = -1;
+
+	memcpy(hdr.magic, ETC_MAGIC, sizeof(hdr.magic));
+	hdr.width = job->width;
+	hdr.height = job->height;
+	hdr.format = alpha ? GL_COMPRESSED_RGBA8_ETC2_EAC : GL_COMPRESSED_RGB8_ETC2;
+	hdr.size = etc2_size(job->width, job->height, alpha);
+	hdr.srcsize = job->st.st_size;
+	hdr.srcmtime = stat_mtime(&job->st);
+	hdr.hash = job->hash;
+
+	blocks = malloc(hdr.size);
+	if (!blocks)
+		return -1;
+	etc2_encode(blocks, job->data, job->width, job->height, job->channels,
+		    alpha, etc2quality);
+	if (fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fwrite(blocks, hdr.size, 1, f) == 1)
+		ret = 0;
+	free(blocks);
+	return ret;
+}
+
+static int
+etc_build(struct job *job)
+{
+	return cache_write(job->etcpath, etc_write, job);
 }
 
 static void
-xev_selnotify(XEvent *e)
+etc_close(struct etc *e)
 {
-	unsigned long n;
-	int fmt;
-	char *uri, *data;
-	Atom type, prop = None;
+	if (e->map)
+		munmap(e->map, e->size);
+	memset(e, 0, sizeof(*e));
+}
 
-	if (e->type == SelectionNotify)
-		prop = e->xselection.property;
-	if (prop == None)
-		return;
-	data = xgetprop(win, prop, &type, &fmt, &n);
-	if (!data)
-		err("selection allocation failed\n");
+static int
+etc_open(struct etc *e, const char *path, const struct stat *st)
+{
+	const struct etc_header *hdr;
+
+	memset(e, 0, sizeof(*e));
+	e->map = cache_map(path, sizeof(*hdr), &e->size);
+	if (!e->map)
+		return -1;
+
+	hdr = e->hdr = (void *)e->map;
+	if (memcmp(hdr->magic, ETC_MAGIC, sizeof(hdr->magic)) != 0
+	    || hdr->srcsize != (uint64_t)st->st_size
+	    || hdr->srcmtime != stat_mtime(st)
+	    || hdr->width < 1 || hdr->height < 1
+	    || (hdr->format != GL_COMPRESSED_RGB8_ETC2
+		&& hdr->format != GL_COMPRESSED_RGBA8_ETC2_EAC)
+	    || hdr->size != etc2_size(hdr->width, hdr->height,
+				      hdr->format == GL_COMPRESSED_RGBA8_ETC2_EAC)
+	    || e->size - sizeof(*hdr) < hdr->size) {
+		etc_close(e);
+		return -1;
+	}
+	return 0;
+}
+
+static GLenum
+channels_format(int n)
+{
+	if (n == 2)
+		return GL_RG;
+	else if (n == 3)
+		return GL_RGB;
+	else if (n == 4)
+		return GL_RGBA;
+	return GL_RED;
+}
+
+static GLenum
+channels_internalformat(int n)
+{
+	if (n == 2)
+		return GL_RG8;
+	else if (n == 3)
+		return GL_RGB8;
+	else if (n == 4)
+		return GL_RGBA8;
+	return GL_R8;
+}
+
+static struct texture
+create_image_pyramid(const struct pyramid *p)
+{
+	const struct pyr_header *hdr = p->hdr;
+	struct texture img = { 0 };
+	GLenum format = channels_format(hdr->channels);
+	size_t ts = hdr->tilesize;
+	GLint maxsize = 0;
+	size_t base, l, t;
+	double start;
+
+	/* the finer levels are paged by tiles, see render_tiles */
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxsize);
+	if (maxsize > PYR_OVERVIEW)
+		maxsize = PYR_OVERVIEW;
+	for (base = 0; base + 1 < hdr->levels; base++)
+		if (p->lvl[base].width <= (size_t)maxsize
+		    && p->lvl[base].height <= (size_t)maxsize)
+			break;
+	img.lodbias = lodbias;
+	base = base + lodbias < hdr->levels ? base + lodbias : hdr->levels - 1;
+	img.pyrbase = base;
+
+	img.type = GL_TEXTURE_2D;
+	img.format = format;
+	img.width = hdr->width;
+	img.height = hdr->height;
+	img.cached = 1;
+	img.pyramid = 1;
+	for (l = base; l < hdr->levels; l++)
+		img.texsize += (size_t)p->lvl[l].width * p->lvl[l].height
+			* (hdr->channels == 3 ? 4 : hdr->channels);
 
-	uri = strtok(data, "\r\n");
-	while (uri != NULL) {
-		if (strncmp(uri, "file://", strlen("file://")) == 0) {
-			uri += strlen("file://");
-			urldecode(uri, uri, strlen(uri) + 1);
-			load(uri);
+	glGenTextures(1, &img.id);
+	glBindTexture(img.type, img.id);
+	texture_params(img.type, format);
+	glTexParameteri(img.type, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(img.type, GL_TEXTURE_MAX_LEVEL, hdr->levels - 1 - base);
+	glTexStorage2D(img.type, hdr->levels - base,
+		       channels_internalformat(hdr->channels),
+		       p->lvl[base].width, p->lvl[base].height);
+
+	/* tiles are uploaded straight from the mapping */
+	glPixelStorei(GL_UNPACK_ALIGNMENT, row_alignment(ts * hdr->channels));
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, ts);
+	start = now();
+	for (l = base; l < hdr->levels; l++) {
+		const struct pyr_level *lvl = &p->lvl[l];
+		for (t = 0; t < (size_t)lvl->tilesx * lvl->tilesy; t++) {
+			size_t tx = (t % lvl->tilesx) * ts;
+			size_t ty = (t / lvl->tilesx) * ts;
+			size_t tw = lvl->width - tx < ts ? lvl->width - tx : ts;
+			size_t th = lvl->height - ty < ts ? lvl->height - ty : ts;
+			const unsigned char *tile = p->map + p->index[lvl->index + t];
+
+			glTexSubImage2D(img.type, l - base, tx, ty, tw, th,
+					format, GL_UNSIGNED_BYTE, tile);
+			upload_stat(UP_MEMORY, format, tw * th, start);
+			start = now();
 		}
-		uri = strtok(NULL, "\r\n");
 	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 
-	XFree(data);
-	XDeleteProperty(dpy, win, prop);
+	return img;
+}
+
+/*
+ * Tiles of the pyramid levels finer than the one held whole by the
+ * texture, uploaded for the part of the image in view once it is zoomed
+ * in past that level.  They take up to TILE_BYTES of video memory, the
+ * tiles out of view for the longest time are dropped first.
+ */
+#define TILE_CACHE 1024
+#define TILE_BYTES (64 * 1024 * 1024)
+
+static struct tile {
+	GLuint id;
+	unsigned long uid; /* of the texture */
+	size_t level, index;
+	size_t size;
+	unsigned long seen;
+} tiles[TILE_CACHE];
+static size_t tileused;
+
+static void
+tile_free(struct tile *e)
+{
+	glDeleteTextures(1, &e->id);
+	tileused -= e->size;
+	memset(e, 0, sizeof(*e));
 }
 
+/* drop the tiles of a texture, or all of them when uid is 0 */
 static void
-xev_keypress(XEvent *ev)
+tiles_forget(unsigned long uid)
 {
-	XKeyEvent *e = &ev->xkey;
-	unsigned int s = e->state;
-	KeySym k = XLookupKeysym(e, 1);
 	size_t i;
 
-	for (i = 0; i < LEN(shortcuts); i++) {
-		if (k == shortcuts[i].keysym && mod_match(shortcuts[i].mod, s))
-			return shortcuts[i].func();
+	for (i = 0; i < LEN(tiles); i++)
+		if (tiles[i].id && (!uid || tiles[i].uid == uid))
+			tile_free(&tiles[i]);
+}
+
+/* a slot with room for size bytes, NULL if the tiles in view take it all */
+static struct tile *
+tile_slot(size_t size)
+{
+	struct tile *e, *slot, *old;
+	size_t i;
+
+	for (;;) {
+		slot = old = NULL;
+		for (i = 0; i < LEN(tiles); i++) {
+			e = &tiles[i];
+			if (!e->id) {
+				if (!slot)
+					slot = e;
+			} else if (e->seen != frameno && (!old || e->seen < old->seen)) {
+				old = e;
+			}
+		}
+		if (slot && tileused + size <= TILE_BYTES)
+			return slot;
+		if (!old)
+			return NULL;
+		tile_free(old);
+	}
+}
+
+/* texture of a tile of the level l, 0 if not uploaded yet */
+static GLuint
+tile_get(struct texture *t, size_t l, size_t index)
+{
+	const struct pyramid *p = t->pyr;
+	const struct pyr_level *lvl = &p->lvl[l];
+	size_t ts = p->hdr->tilesize;
+	size_t n = p->hdr->channels;
+	size_t tx = index % lvl->tilesx * ts;
+	size_t ty = index / lvl->tilesx * ts;
+	size_t tw = lvl->width - tx < ts ? lvl->width - tx : ts;
+	size_t th = lvl->height - ty < ts ? lvl->height - ty : ts;
+	GLenum format = channels_format(n);
+	struct tile *e;
+	double start;
+	size_t i;
+
+	for (i = 0; i < LEN(tiles); i++) {
+		e = &tiles[i];
+		if (e->id && e->uid == t->uid && e->level == l && e->index == index) {
+			e->seen = frameno;
+			return e->id;
+		}
+	}
+	if (tileuploads == 0) {
+		tilesleft = 1;
+		return 0;
 	}
+	if (!(e = tile_slot(tw * th * (n == 3 ? 4 : n))))
+		return 0;
+	tileuploads--;
+	e->uid = t->uid;
+	e->level = l;
+	e->index = index;
+	e->size = tw * th * (n == 3 ? 4 : n);
+	e->seen = frameno;
+	tileused += e->size;
+
+	glGenTextures(1, &e->id);
+	glBindTexture(GL_TEXTURE_2D, e->id);
+	texture_params(GL_TEXTURE_2D, format);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, row_alignment(ts * n));
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, ts);
+	start = now();
+	glTexImage2D(GL_TEXTURE_2D, 0, channels_internalformat(n), tw, th, 0,
+		     format, GL_UNSIGNED_BYTE, p->map + p->index[lvl->index + index]);
+	upload_stat(UP_MEMORY, format, tw * th, start);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	return e->id;
 }
 
+/* draw the tiles in view over the image at x, y, w, h in the window */
 static void
-xev_cmessage(XEvent *ev)
+render_tiles(struct image *i, int x, int y, int w, int h)
 {
-	if (ev->xclient.message_type == xdndenter) {
-		Window src = ev->xclient.data.l[0];
-		int version = ev->xclient.data.l[1] >> 24;
-		int typelist = ev->xclient.data.l[1] & 1;
+	struct texture *t = i->tex;
+	const struct pyr_level *lvl;
+	double s = zoom * i->scale;
+	double lw, lh, u0, u1, v0, v1;
+	size_t l, ts, tx, ty, tx0, tx1, ty0, ty1, tw, th;
+	int cx0 = x > clip.x0 ? x : clip.x0;
+	int cy0 = y > clip.y0 ? y : clip.y0;
+	int cx1 = x + w < clip.x1 ? x + w : clip.x1;
+	int cy1 = y + h < clip.y1 ? y + h : clip.y1;
+	GLuint id;
 
-		if (version < dndversion)
-			err("unsupported dnd version %d\n", version);
-		if (typelist) {
-			Atom type = None;
-			int fmt;
-			Atom *data = NULL;
-			unsigned long n;
-			data = xgetprop(src, xdndtypelist, &type, &fmt, &n);
-			dndtarget = dndmatchtarget(n, data);
-			XFree(data);
-		} else {
-			dndtarget = dndmatchtarget(3, (Atom *) &ev->xclient.data.l[2]);
+	if (cx0 >= cx1 || cy0 >= cy1 || w <= 0 || h <= 0)
+		return;
+	/* the finest level not shown larger than its pixels */
+	for (l = 0; l < (size_t)t->pyrbase && s * 2 <= 1; l++)
+		s *= 2;
+	if (l >= (size_t)t->pyrbase)
+		return; /* the texture is fine enough */
+
+	lvl = &t->pyr->lvl[l];
+	ts = t->pyr->hdr->tilesize;
+	lw = lvl->width;
+	lh = lvl->height;
+	u0 = (cx0 - x) * lw / w;
+	u1 = (cx1 - x) * lw / w;
+	v0 = (y + h - cy1) * lh / h;
+	v1 = (y + h - cy0) * lh / h;
+	tx0 = u0 / ts;
+	ty0 = v0 / ts;
+	tx1 = (size_t)(u1 / ts) < lvl->tilesx ? (size_t)(u1 / ts) : lvl->tilesx - 1;
+	ty1 = (size_t)(v1 / ts) < lvl->tilesy ? (size_t)(v1 / ts) : lvl->tilesy - 1;
+
+	scissor(x, y, w, h, 0);
+	glUniform1i(loc_layer, -1);
+	for (ty = ty0; ty <= ty1; ty++) {
+		for (tx = tx0; tx <= tx1; tx++) {
+			if (!(id = tile_get(t, l, ty * lvl->tilesx + tx)))
+				continue;
+			tw = lw - tx * ts < ts ? lw - tx * ts : ts;
+			th = lh - ty * ts < ts ? lh - ty * ts : ts;
+			glBindTexture(GL_TEXTURE_2D, id);
+			glUniform2f(loc_off, x + tx * ts * w / lw,
+				    y + h - (ty * ts + th) * h / lh);
+			glUniform2f(loc_ext, tw * w / lw, th * h / lh);
+			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 		}
-	} else if (ev->xclient.message_type == xdndposition) {
-		Window src = ev->xclient.data.l[0];
-		Atom action = ev->xclient.data.l[4];
-		/* accept the drag-n-drop if we matched a target,
-		 * only xdndacopy action is supported */
-		int accept = dndtarget != None && action == xdndacopy;
-		XClientMessageEvent m = {
-			.type = ClientMessage,
-			.display = dpy,
-			.window = src,
-			.message_type = xdndstatus,
-			.format = 32,
-			.data.l = { win, accept, 0, 0, xdndacopy},
-		};
+	}
+}
+
+/* the texture holds the pyramid p, its tiles are paged from the mapping */
+static void
+texture_page(struct texture *t, struct pyramid *p)
+{
+	if ((t->pyr = malloc(sizeof(*t->pyr)))) {
+		*t->pyr = *p;
+		memset(p, 0, sizeof(*p));
+	}
+}
+
+static void
+texture_unpage(struct texture *t)
+{
+	if (!t->pyr)
+		return;
+	tiles_forget(t->uid);
+	pyramid_close(t->pyr);
+	free(t->pyr);
+	t->pyr = NULL;
+}
+
+static struct texture
+create_image_etc(const struct etc *e)
+{
+	const struct etc_header *hdr = e->hdr;
+	struct texture img = { 0 };
+	double start;
+
+	img.type = GL_TEXTURE_2D;
+	img.format = hdr->format;
+	img.width = hdr->width;
+	img.height = hdr->height;
+	img.cached = 1;
+	img.texsize = hdr->size;
+
+	glGenTextures(1, &img.id);
+	glBindTexture(img.type, img.id);
+	texture_params(img.type, hdr->format == GL_COMPRESSED_RGB8_ETC2 ? GL_RGB : GL_RGBA);
+	start = now();
+	glCompressedTexImage2D(img.type, 0, hdr->format, hdr->width, hdr->height, 0,
+			       hdr->size, e->map + sizeof(*hdr));
+	upload_stat(UP_MEMORY, hdr->format, img.width * img.height, start);
+
+	return img;
+}
+
+static void
+job_free(struct job *job)
+{
+	if (job->qoif || job->kind == JOB_PREVIEW)
+		free(job->data);
+	else
+		stbi_image_free(job->data);
+	pyramid_close(&job->pyr);
+	etc_close(&job->etc);
+	free(job->file);
+	free(job->name);
+	free(job->target);
+	free(job->delays);
+	while (job->count > 0)
+		free(job->names[--job->count]);
+	free(job->names);
+	free(job);
+}
+
+static void
+queue_push(struct queue *q, struct job *job)
+{
+	job->next = NULL;
+	if (q->tail)
+		q->tail->next = job;
+	else
+		q->head = job;
+	q->tail = job;
+}
+
+static struct job *
+queue_pop(struct queue *q)
+{
+	struct job *job = q->head;
+
+	if (job) {
+		q->head = job->next;
+		if (!q->head)
+			q->tail = NULL;
+	}
+	return job;
+}
+
+/* jobs holding a mapped buffer go first */
+static void
+loader_push_front(struct job *job)
+{
+	pthread_mutex_lock(&loadlock);
+	job->next = todo.head;
+	todo.head = job;
+	if (!todo.tail)
+		todo.tail = job;
+	pthread_cond_signal(&loadcond);
+	pthread_mutex_unlock(&loadlock);
+}
+
+static void
+loader_push(struct job *job)
+{
+	pthread_mutex_lock(&loadlock);
+	queue_push(&todo, job);
+	pthread_cond_signal(&loadcond);
+	pthread_mutex_unlock(&loadlock);
+}
+
+/* hand a job back to the main thread */
+static void
+loader_post(struct job *job)
+{
+	pthread_mutex_lock(&loadlock);
+	queue_push(&done, job);
+	pthread_mutex_unlock(&loadlock);
+	while (write(wakefd[1], "", 1) < 0 && errno == EINTR)
+		;
+}
+
+#ifdef HAVE_SSSE3
+static int cpussse3; /* set before the workers start */
+
+/* returns the pixels expanded, the last ones are left to the caller */
+__attribute__((target("ssse3"))) static size_t
+rgb_to_rgba_ssse3(unsigned char *dst, const unsigned char *src, size_t npx)
+{
+	const __m128i shuf = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+					   6, 7, 8, -1, 9, 10, 11, -1);
+	const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+	size_t i;
+
+	/* 16 bytes are loaded for the 12 used, stop before reading past */
+	for (i = 0; i + 6 <= npx; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i * 3));
+		v = _mm_or_si128(_mm_shuffle_epi8(v, shuf), alpha);
+		_mm_storeu_si128((__m128i *)(dst + i * 4), v);
+	}
+	return i;
+}
+#endif
+
+/* expand RGB pixels to opaque RGBA */
+static void
+rgb_to_rgba(unsigned char *dst, const unsigned char *src, size_t npx)
+{
+	size_t i = 0;
+
+#ifdef HAVE_SSSE3
+	if (cpussse3)
+		i = rgb_to_rgba_ssse3(dst, src, npx);
+#endif
+	for (; i < npx; i++) {
+		dst[i * 4 + 0] = src[i * 3 + 0];
+		dst[i * 4 + 1] = src[i * 3 + 1];
+		dst[i * 4 + 2] = src[i * 3 + 2];
+		dst[i * 4 + 3] = 0xff;
+	}
+}
+
+static void
+publish_preview(void *arg, unsigned char *data, int w, int h, int n)
+{
+	struct job *job = arg;
+	struct job *p = calloc(1, sizeof(*p));
+	unsigned char *rgba;
+
+	if (!p) {
+		free(data);
+		return;
+	}
+	if (n == 3 && (rgba = malloc((size_t)w * h * 4))) {
+		rgb_to_rgba(rgba, data, (size_t)w * h);
+		free(data);
+		data = rgba;
+		n = 4;
+	}
+	p->kind = JOB_PREVIEW;
+	p->uid = job->uid;
+	p->width = job->width;
+	p->height = job->height;
+	p->data = data;
+	p->pw = w;
+	p->ph = h;
+	p->channels = n;
+	loader_post(p);
+}
+
+/* the whole image is needed to write its pyramid */
+static int
+job_wants_pyramid(struct job *job, int w, int h)
+{
+	return job->cached && pyramidpixels
+		&& ((size_t)w * h >= pyramidpixels || w > maxtexsize || h > maxtexsize);
+}
+
+/* the whole image is needed to compress it */
+static int
+job_wants_etc(struct job *job, int w, int h)
+{
+	return job->cached && etc2quality >= 0 && !job_wants_pyramid(job, w, h)
+		&& w <= maxtexsize && h <= maxtexsize;
+}
+
+/*
+ * Decode a QOI image by bands of rows which are uploaded as soon as
+ * they are decoded, the whole image never sits in memory and the upload
+ * overlaps the decoding.
+ */
+static int
+job_bands(struct job *job, const unsigned char *file, size_t len)
+{
+	struct qoidec dec;
+	struct job *band;
+	size_t p, used, rowbytes, rows, px;
+	int y;
+
+	p = qoidec_init(&dec, file, len, job->channels);
+	if (p == 0)
+		return -1;
+	job->width = dec.desc.width;
+	job->height = dec.desc.height;
+	job->channels = dec.channels;
+	rowbytes = (size_t)job->width * job->channels;
+	rows = bandbytes / rowbytes ? bandbytes / rowbytes : 1;
+
+	for (y = 0; y < job->height; y += rows) {
+		pthread_mutex_lock(&loadlock);
+		while (job->inflight >= BANDS_INFLIGHT)
+			pthread_cond_wait(&bandcond, &loadlock);
+		pthread_mutex_unlock(&loadlock);
+
+		band = calloc(1, sizeof(*band));
+		if (!band)
+			return -1;
+		band->kind = JOB_BAND;
+		band->uid = job->uid;
+		band->width = job->width;
+		band->height = job->height;
+		band->pw = job->width;
+		band->ph = (size_t)(job->height - y) < rows ? (size_t)(job->height - y) : rows;
+		band->y = y;
+		band->channels = job->channels;
+		band->qoif = 1;
+		band->reload = job->reload;
+		band->parent = job;
+		band->data = malloc(rowbytes * band->ph);
+		if (!band->data) {
+			free(band);
+			return -1;
+		}
+		used = qoidec_pixels(&dec, file + p, len - p, band->data,
+				     (size_t)band->pw * band->ph, &px);
+		p += used;
+		if (px != (size_t)band->pw * band->ph) {
+			job_free(band);
+			return -1;
+		}
+
+		pthread_mutex_lock(&loadlock);
+		job->inflight++;
+		pthread_mutex_unlock(&loadlock);
+		loader_post(band);
+	}
+	return 0;
+}
+
+/* decode the file into the mapped buffer if any, in memory otherwise */
+static int
+job_decode(struct job *job)
+{
+	int w = 0, h = 0, n = 0;
+
+	if (job->qoif && job->dst) {
+		struct qoidec dec;
+		size_t p, px;
+
+		p = qoidec_init(&dec, job->file, job->len, job->channels);
+		if (p == 0)
+			return -1;
+		qoidec_pixels(&dec, job->file + p, job->len - p, job->dst,
+			      (size_t)job->width * job->height, &px);
+		return px == (size_t)job->width * job->height ? 0 : -1;
+	}
+
+	if (job->qoif) {
+		qoi_desc desc;
+		job->data = qoi_decode(job->file, job->len, &desc, job->channels);
+		w = desc.width;
+		h = desc.height;
+		n = job->channels;
+	} else {
+		job->data = stbi_load_from_memory(job->file, job->len, &w, &h, &n, 0);
+	}
+	if (job->data == NULL || w != job->width || h != job->height)
+		return -1;
+	if (n == 3 && job->channels == 4) {
+		unsigned char *rgba = job->dst;
+
+		if (!rgba && !(rgba = malloc((size_t)w * h * 4)))
+			return -1;
+		rgb_to_rgba(rgba, job->data, (size_t)w * h);
+		stbi_image_free(job->data);
+		job->data = job->dst ? NULL : rgba;
+		return 0;
+	}
+	if (n != job->channels)
+		return -1;
+	if (job->dst) {
+		/* stb_image only decodes to its own buffer */
+		memcpy(job->dst, job->data, (size_t)w * h * n);
+		stbi_image_free(job->data);
+		job->data = NULL;
+	}
+	return 0;
+}
+
+static void
+job_finish(struct job *job)
+{
+	if (job_decode(job) < 0)
+		job->kind = JOB_FAIL;
+	else
+		job->kind = job->dst ? JOB_UPLOAD : JOB_IMAGE;
+	free(job->file);
+	job->file = NULL;
+}
+
+/*
+ * Look for a texture of the same content, returns 1 if the job is done
+ * and the texture of the job can be replaced by the shared one.
+ */
+static int
+job_share(struct job *job)
+{
+	size_t i;
+
+	pthread_mutex_lock(&loadlock);
+	for (i = 0; i < hashcount; i++) {
+		if (hashes[i].gone && hashes[i].uid == job->uid) {
+			/* the texture of the job went away */
+			pthread_mutex_unlock(&loadlock);
+			return 0;
+		}
+		if (!hashes[i].gone && hashes[i].hash == job->hash)
+			break;
+	}
+	if (i == hashcount && hashcount < LEN(hashes)) {
+		hashes[hashcount].hash = job->hash;
+		hashes[hashcount].gone = 0;
+		hashes[hashcount++].uid = job->uid;
+	}
+	job->shareuid = i < hashcount ? hashes[i].uid : 0;
+	pthread_mutex_unlock(&loadlock);
+
+	if (job->shareuid == 0 || job->shareuid == job->uid)
+		return 0;
+	pyramid_close(&job->pyr);
+	etc_close(&job->etc);
+	job->kind = JOB_SHARE;
+	return 1;
+}
+
+#ifdef SYS_io_uring_setup
+/*
+ * Files are read through io_uring when the kernel has it, the reader
+ * thread keeps up to READ_INFLIGHT files open and being read at once and
+ * hands them to the workers as they complete.  Without it, the workers
+ * read the files themselves.
+ */
+#define READ_INFLIGHT 64
+
+static struct {
+	int fd;
+	unsigned *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned queued; /* entries not yet submitted */
+	int inflight; /* files being read */
+	int off; /* no more files, set on errors */
+} ring = { .fd = -1 };
+static pthread_cond_t readcond = PTHREAD_COND_INITIALIZER;
+static struct queue reads;
+
+static struct io_uring_sqe *
+ring_sqe(struct job *job, int op, int fd)
+{
+	struct io_uring_sqe *sqe = &ring.sqes[*ring.sqtail & *ring.sqmask];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->user_data = (uintptr_t)job;
+	return sqe;
+}
+
+/* make the entry filled last visible to the kernel */
+static void
+ring_commit(void)
+{
+	unsigned tail = *ring.sqtail;
+
+	ring.sqarray[tail & *ring.sqmask] = tail & *ring.sqmask;
+	__atomic_store_n(ring.sqtail, tail + 1, __ATOMIC_RELEASE);
+	ring.queued++;
+}
+
+static void
+ring_read(struct job *job)
+{
+	struct io_uring_sqe *sqe = ring_sqe(job, IORING_OP_READ, job->fd);
+	size_t left = job->st.st_size - job->len;
+
+	sqe->addr = (uintptr_t)(job->file + job->len);
+	sqe->len = left < INT_MAX ? left : INT_MAX;
+	sqe->off = job->len;
+	ring_commit();
+}
+
+static void
+ring_done(struct job *job, int res)
+{
+	if (res >= 0 && job->fd < 0) {
+		/* opened, read it whole */
+		job->fd = res;
+		job->len = 0;
+		if ((job->file = malloc(job->st.st_size))) {
+			ring_read(job);
+			return;
+		}
+		res = -ENOMEM;
+	} else if (res > 0) {
+		job->len += res;
+		if (job->len < (size_t)job->st.st_size) {
+			ring_read(job);
+			return;
+		}
+	}
+	if (job->fd >= 0)
+		close(job->fd);
+	job->fd = -1;
+	ring.inflight--;
+
+	if (res == -EINVAL && !job->file) {
+		/* no IORING_OP_OPENAT before Linux 5.6, the workers read */
+		pthread_mutex_lock(&loadlock);
+		ring.off = 1;
+		pthread_mutex_unlock(&loadlock);
+		job->kind = JOB_LOAD;
+		loader_push(job);
+	} else if (res < 0) {
+		err("%s: %s\n", job->name, strerror(-res));
+		free(job->file);
+		job->file = NULL;
+		job->kind = JOB_FAIL;
+		loader_post(job);
+	} else {
+		/* read whole, or shorter if the file shrank since its stat */
+		job->kind = JOB_LOAD;
+		loader_push(job);
+	}
+}
+
+static void *
+reader(void *arg)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct job *job;
+	unsigned head;
+	long n;
+
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&loadlock);
+		while (!ring.off && !ring.inflight && !reads.head)
+			pthread_cond_wait(&readcond, &loadlock);
+		while (!ring.off && ring.inflight < READ_INFLIGHT && (job = queue_pop(&reads))) {
+			sqe = ring_sqe(job, IORING_OP_OPENAT, AT_FDCWD);
+			sqe->addr = (uintptr_t)job->name;
+			sqe->open_flags = O_RDONLY | O_CLOEXEC;
+			ring_commit();
+			ring.inflight++;
+		}
+		pthread_mutex_unlock(&loadlock);
+		if (ring.off && !ring.inflight)
+			break;
+
+		n = syscall(SYS_io_uring_enter, ring.fd, ring.queued, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			die("io_uring_enter: %s\n", strerror(errno));
+		if (n > 0)
+			ring.queued -= n;
+
+		head = *ring.cqhead;
+		while (head != __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE)) {
+			cqe = &ring.cqes[head & *ring.cqmask];
+			job = (struct job *)(uintptr_t)cqe->user_data;
+			n = cqe->res;
+			__atomic_store_n(ring.cqhead, ++head, __ATOMIC_RELEASE);
+			ring_done(job, n);
+		}
+	}
+	close(ring.fd);
+
+	/* the files left go back to the workers */
+	pthread_mutex_lock(&loadlock);
+	while ((job = queue_pop(&reads))) {
+		job->kind = JOB_LOAD;
+		queue_push(&todo, job);
+	}
+	pthread_cond_broadcast(&loadcond);
+	pthread_mutex_unlock(&loadlock);
+	return NULL;
+}
+
+static void
+reader_init(void)
+{
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+	size_t sqsize, cqsize;
+	pthread_t tid;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(SYS_io_uring_setup, READ_INFLIGHT, &p);
+	if (fd < 0)
+		return;
+	sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sqsize = cqsize = sqsize > cqsize ? sqsize : cqsize;
+	sq = mmap(NULL, sqsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQ_RING);
+	cq = sq;
+	if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+		cq = mmap(NULL, cqsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_CQ_RING);
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			 PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || ring.sqes == MAP_FAILED) {
+		close(fd); /* the mappings go away with it */
+		return;
+	}
+	ring.sqtail = (unsigned *)(sq + p.sq_off.tail);
+	ring.sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring.sqarray = (unsigned *)(sq + p.sq_off.array);
+	ring.cqhead = (unsigned *)(cq + p.cq_off.head);
+	ring.cqtail = (unsigned *)(cq + p.cq_off.tail);
+	ring.cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ring.fd = fd;
+	if (pthread_create(&tid, NULL, reader, NULL) != 0) {
+		close(fd);
+		ring.fd = -1;
+		return;
+	}
+	pthread_detach(tid);
+}
+
+/* hand the file to the reader, returns -1 when the worker reads it */
+static int
+reader_read(struct job *job)
+{
+	int ret = -1;
+
+	if (!S_ISREG(job->st.st_mode) || job->st.st_size <= 0 || job->st.st_size > INT_MAX)
+		return -1;
+	pthread_mutex_lock(&loadlock);
+	if (ring.fd >= 0 && !ring.off) {
+		job->kind = JOB_READ;
+		job->fd = -1;
+		queue_push(&reads, job);
+		pthread_cond_signal(&readcond);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&loadlock);
+	return ret;
+}
+#else
+static void
+reader_init(void)
+{
+}
+
+static int
+reader_read(struct job *job)
+{
+	(void)job;
+	return -1;
+}
+#endif
+
+/* decode all the frames of an animated GIF */
+static int
+job_anim(struct job *job, unsigned char *file, size_t len)
+{
+	int w, h, z, n;
+
+	job->data = stbi_load_gif_from_memory(file, len, &job->delays, &w, &h, &z, &n, 4);
+	if (!job->data || z < 2) {
+		/* a still image goes the usual way */
+		stbi_image_free(job->data);
+		job->data = NULL;
+		free(job->delays);
+		job->delays = NULL;
+		return -1;
+	}
+	job->width = job->pw = w;
+	job->height = job->ph = h;
+	job->channels = 4;
+	job->frames = z < maxlayers ? z : maxlayers;
+	job->kind = JOB_ANIM;
+	return 0;
+}
+
+/* returns 1 when the file is handed to the reader */
+static int
+job_load(struct job *job)
+{
+	struct qoidec dec;
+	unsigned char *file;
+	size_t len;
+	int n = 0;
+
+	if (job->file) {
+		/* back from the reader */
+		file = job->file;
+		len = job->len;
+		job->file = NULL;
+		goto read;
+	}
+
+	job->cached = stat(job->name, &job->st) == 0
+		&& cache_path(job->path, sizeof(job->path), job->name, &job->st, "pyr") == 0;
+	if (job->cached) {
+		/* same name, other extension */
+		memcpy(job->etcpath, job->path, sizeof(job->etcpath));
+		memcpy(strrchr(job->etcpath, '.'), ".etc", 4);
+	}
+	if (job->cached && pyramid_open(&job->pyr, job->path, &job->st) == 0) {
+		job->hash = job->pyr.hdr->hash;
+		if (!job_share(job))
+			job->kind = JOB_TILES;
+		return 0;
+	}
+	if (job->cached && etc2quality >= 0 && etc_open(&job->etc, job->etcpath, &job->st) == 0) {
+		job->hash = job->etc.hdr->hash;
+		if (!job_share(job))
+			job->kind = JOB_ETC;
+		return 0;
+	}
+	if (reader_read(job) == 0)
+		return 1;
+
+	file = file_read(job->name, &len);
+read:
+	job->kind = JOB_FAIL;
+	if (file == NULL || len == 0 || len > INT_MAX) {
+		free(file);
+		return 0;
+	}
+	job->hash = fnv1a(FNV_OFFSET, file, len);
+	if (!job->stream && job_share(job)) {
+		free(file);
+		return 0;
+	}
+	if (len > 6 && memcmp(file, "GIF8", 4) == 0 && job_anim(job, file, len) == 0) {
+		free(file);
+		return 0;
+	}
+
+	if (len > 22 && strncmp((char *)file, "qoif", strlen("qoif")) == 0) {
+		job->qoif = 1;
+		if (qoidec_init(&dec, file, len, 0)) {
+			job->width = dec.desc.width;
+			job->height = dec.desc.height;
+			n = dec.channels;
+		}
+	} else if (stbi_info_from_memory(file, len, &job->width, &job->height, &n)
+		   && (size_t)job->width * job->height >= previewpixels && !job->reload) {
+		/* show the early passes while the whole image decodes */
+		if (!preview_png(file, len, publish_preview, job))
+			preview_jpeg(file, len, publish_preview, job);
+	}
+	if (n == 0) {
+		free(file);
+		return 0;
+	}
+	job->pw = job->width;
+	job->ph = job->height;
+	/* most drivers repack 3 byte pixels one by one, expand them here */
+	job->channels = n == 3 ? 4 : n;
+	job->file = file;
+	job->len = len;
+
+	if (!job_wants_pyramid(job, job->width, job->height)
+	    && !job_wants_etc(job, job->width, job->height)) {
+		if (job->width <= maxtexsize && job->height <= maxtexsize && !job->nopbo
+		    && (size_t)job->width * job->height * job->channels <= pbobytes) {
+			/* decoded once the main thread mapped a buffer */
+			job->kind = JOB_MAP;
+			return 0;
+		}
+		if (job->qoif) {
+			job->kind = job_bands(job, file, len) == 0 ? JOB_DONE : JOB_FAIL;
+			return 0;
+		}
+	}
+
+	job_finish(job);
+	if (job->kind == JOB_IMAGE && job->cached
+	    && (job->width > maxtexsize || job->height > maxtexsize)) {
+		/* too large for a single texture, build the pyramid now */
+		if (pyramid_build(job) == 0 && pyramid_open(&job->pyr, job->path, &job->st) == 0)
+			job->kind = JOB_TILES;
+		else
+			job->kind = JOB_FAIL;
+	}
+	return 0;
+}
+
+/* compress the pixels read back from an evicted texture */
+static void
+job_evict(struct job *job)
+{
+	size_t i, npx = (size_t)job->width * job->height;
+	unsigned char *p;
+	qoi_desc desc;
+	int len = 0;
+
+	/* the mapping is read only */
+	if (!(p = job->data = malloc(npx * 4))) {
+		job->kind = JOB_STORE;
+		return;
+	}
+	memcpy(job->data, job->dst, npx * 4);
+
+	/* the swizzle of grey textures does not apply to glReadPixels */
+	for (i = 0; job->channels < 3 && i < npx; i++, p += 4) {
+		p[3] = job->channels == 2 ? p[1] : 255;
+		p[1] = p[2] = p[0];
+	}
+	desc.width = job->width;
+	desc.height = job->height;
+	desc.channels = 4;
+	desc.colorspace = QOI_SRGB;
+	job->file = qoi_encode(job->data, &desc, &len);
+	job->len = job->file ? len : 0;
+	free(job->data);
+	job->data = NULL;
+	job->kind = JOB_STORE;
+}
+
+/*
+ * Directories are scanned by the workers, each subdirectory is a job of
+ * its own so that a tree is scanned in parallel.
+ */
+struct dir {
+#ifdef SYS_getdents64
+	int fd;
+	size_t len, off;
+	char buf[32768];
+#else
+	DIR *dp;
+#endif
+};
+
+static int
+dir_open(struct dir *d, const char *name)
+{
+#ifdef SYS_getdents64
+	d->len = d->off = 0;
+	d->fd = open(name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	return d->fd < 0 ? -1 : 0;
+#else
+	d->dp = opendir(name);
+	return d->dp ? 0 : -1;
+#endif
+}
+
+static int
+dir_fd(struct dir *d)
+{
+#ifdef SYS_getdents64
+	return d->fd;
+#else
+	return dirfd(d->dp);
+#endif
+}
+
+static void
+dir_close(struct dir *d)
+{
+#ifdef SYS_getdents64
+	close(d->fd);
+#else
+	closedir(d->dp);
+#endif
+}
+
+/* returns the next entry and its file type, 0 when it is not known */
+static const char *
+dir_next(struct dir *d, mode_t *type)
+{
+#ifdef SYS_getdents64
+	/* the layout of struct linux_dirent64 */
+	struct {
+		uint64_t ino;
+		int64_t off;
+		unsigned short reclen;
+		unsigned char type;
+		char name[];
+	} *ent;
+	long n;
+
+	if (d->off >= d->len) {
+		n = syscall(SYS_getdents64, d->fd, d->buf, sizeof(d->buf));
+		if (n <= 0)
+			return NULL;
+		d->len = n;
+		d->off = 0;
+	}
+	ent = (void *)(d->buf + d->off);
+	d->off += ent->reclen;
+	switch (ent->type) {
+	case DT_DIR: *type = S_IFDIR; break;
+	case DT_REG: *type = S_IFREG; break;
+	case DT_LNK:
+	case DT_UNKNOWN: *type = 0; break;
+	default: *type = S_IFIFO; break;
+	}
+	return ent->name;
+#else
+	struct dirent *ent = readdir(d->dp);
+
+	*type = 0;
+	return ent ? ent->d_name : NULL;
+#endif
+}
+
+/* returns 1 if the file starts like an image sref can decode */
+static int
+file_sniff(int dirfd, const char *name)
+{
+	static const struct {
+		const char *magic;
+		size_t len;
+	} magics[] = {
+		{ "\x89PNG\r\n\x1a\n", 8 },
+		{ "\xff\xd8\xff", 3 },
+		{ "GIF8", 4 },
+		{ "BM", 2 },
+		{ "8BPS", 4 },
+		{ "#?RADIANCE", 10 },
+		{ "#?RGBE", 6 },
+		{ "\x53\x80\xf6\x34", 4 },
+		{ "P5", 2 },
+		{ "P6", 2 },
+		{ "qoif", 4 },
+	};
+	unsigned char buf[16];
+	const char *ext;
+	ssize_t n;
+	size_t i;
+	int fd;
+
+	fd = openat(dirfd, name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	n = read(fd, buf, sizeof(buf));
+	close(fd);
+	for (i = 0; i < LEN(magics); i++)
+		if (n >= (ssize_t)magics[i].len && memcmp(buf, magics[i].magic, magics[i].len) == 0)
+			return 1;
+	/* targa has no magic */
+	ext = strrchr(name, '.');
+	return n > 0 && ext && strcasecmp(ext, ".tga") == 0;
+}
+
+static int
+namecmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void
+job_scan(struct job *job)
+{
+	struct dir d;
+	struct stat st;
+	struct job *sub;
+	const char *name;
+	char **names = NULL, **p;
+	char *path;
+	size_t n = 0, max = 0;
+	mode_t type;
+
+	job->kind = JOB_FOUND;
+	if (dir_open(&d, job->name) < 0) {
+		err("%s: %s\n", job->name, strerror(errno));
+		return;
+	}
+	while ((name = dir_next(&d, &type))) {
+		if (name[0] == '.')
+			continue; /* hidden, or the directory itself */
+		if (type == 0 && fstatat(dir_fd(&d), name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+			type = st.st_mode & S_IFMT;
+			/* follow links to files, not to directories */
+			if (S_ISLNK(st.st_mode) && fstatat(dir_fd(&d), name, &st, 0) == 0)
+				type = S_ISREG(st.st_mode) ? S_IFREG : 0;
+		}
+		if (!S_ISDIR(type) && !(S_ISREG(type) && file_sniff(dir_fd(&d), name)))
+			continue;
+
+		if (!(path = malloc(strlen(job->name) + strlen(name) + 2)))
+			break;
+		sprintf(path, "%s/%s", job->name, name);
+		if (S_ISDIR(type)) {
+			if (!(sub = calloc(1, sizeof(*sub)))) {
+				free(path);
+				break;
+			}
+			sub->kind = JOB_SCAN;
+			sub->name = path;
+			sub->import = job->import;
+			pthread_mutex_lock(&loadlock);
+			job->import->scans++;
+			pthread_mutex_unlock(&loadlock);
+			loader_push(sub);
+			continue;
+		}
+		if (n == max) {
+			max = max ? max * 2 : 64;
+			if (!(p = realloc(names, max * sizeof(*names)))) {
+				free(path);
+				break;
+			}
+			names = p;
+		}
+		names[n++] = path;
+	}
+	dir_close(&d);
+
+	/* the images of a directory are laid out by name */
+	qsort(names, n, sizeof(*names), namecmp);
+	job->names = names;
+	job->count = n;
+}
+
+/* files dropped are handed back by batches, as they are checked */
+#define DROP_BATCH 256
+
+static void
+job_drop(struct job *job)
+{
+	struct stat st;
+	struct job *sub;
+	size_t i, n = 0;
+	int dir;
+
+	job->kind = JOB_FOUND;
+	for (i = 0; i < job->count; i++) {
+		dir = stat(job->names[i], &st) == 0 && S_ISDIR(st.st_mode);
+		if (!dir) {
+			job->names[n++] = job->names[i];
+			if (n < DROP_BATCH || i + 1 == job->count)
+				continue;
+		}
+		if (!(sub = calloc(1, sizeof(*sub)))) {
+			i += !dir;
+			break;
+		}
+		sub->import = job->import;
+		if (dir) {
+			sub->kind = JOB_SCAN;
+			sub->name = job->names[i];
+		} else {
+			sub->kind = JOB_FOUND;
+			sub->names = malloc(n * sizeof(*sub->names));
+			if (!sub->names) {
+				free(sub);
+				i++;
+				break;
+			}
+			memcpy(sub->names, job->names, n * sizeof(*sub->names));
+			sub->count = n;
+			n = 0;
+		}
+		pthread_mutex_lock(&loadlock);
+		job->import->scans++;
+		pthread_mutex_unlock(&loadlock);
+		if (dir)
+			loader_push(sub);
+		else
+			loader_post(sub);
+	}
+	while (i < job->count)
+		free(job->names[i++]);
+	job->count = n;
+}
+
+/* read ahead the file job_load() is going to read */
+static void
+job_advise(struct job *job)
+{
+	const char *paths[3];
+	size_t i, n = 0;
+	int fd;
+
+	if (stat(job->name, &job->st) == 0
+	    && cache_path(job->path, sizeof(job->path), job->name, &job->st, "pyr") == 0) {
+		memcpy(job->etcpath, job->path, sizeof(job->etcpath));
+		memcpy(strrchr(job->etcpath, '.'), ".etc", 4);
+		paths[n++] = job->path;
+		paths[n++] = job->etcpath;
+	}
+	paths[n++] = job->name;
+
+	/* the first one found is the one loaded */
+	for (i = 0; i < n; i++) {
+		if ((fd = open(paths[i], O_RDONLY | O_CLOEXEC)) < 0)
+			continue;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		close(fd);
+		break;
+	}
+}
+
+static void *
+worker(void *arg)
+{
+	struct job *job;
+
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&loadlock);
+		while (!(job = queue_pop(&todo)))
+			pthread_cond_wait(&loadcond, &loadlock);
+		pthread_mutex_unlock(&loadlock);
+
+		if (job->kind == JOB_PYRAMID) {
+			pyramid_build(job);
+			job_free(job);
+			continue;
+		}
+		if (job->kind == JOB_ADVISE) {
+			job_advise(job);
+			job_free(job);
+			continue;
+		}
+		if (job->kind == JOB_SYNC) {
+			fdatasync(job->fd);
+			close(job->fd);
+			job_free(job);
+			continue;
+		}
+		if (job->kind == JOB_COMPRESS) {
+			if (etc_build(job) == 0
+			    && etc_open(&job->etc, job->etcpath, &job->st) == 0) {
+				job->kind = JOB_ETC;
+				loader_post(job);
+			} else {
+				job_free(job);
+			}
+			continue;
+		}
+		if (job->kind == JOB_DECODE)
+			job_finish(job);
+		else if (job->kind == JOB_EVICT)
+			job_evict(job);
+		else if (job->kind == JOB_SCAN)
+			job_scan(job);
+		else if (job->kind == JOB_DROP)
+			job_drop(job);
+		else if (job->kind == JOB_SESSION)
+			job_session(job);
+		else if (job_load(job))
+			continue; /* now owned by the reader */
+		loader_post(job);
+	}
+	return NULL;
+}
+
+static void
+loader_init(void)
+{
+	pthread_t tid;
+	long i, n = nworkers;
+
+	if (pipe(wakefd) < 0)
+		die("pipe: %s\n", strerror(errno));
+	for (i = 0; i < 2; i++) {
+		fcntl(wakefd[i], F_SETFL, fcntl(wakefd[i], F_GETFL) | O_NONBLOCK);
+		fcntl(wakefd[i], F_SETFD, FD_CLOEXEC);
+	}
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxtexsize);
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxlayers);
+#ifdef HAVE_SSSE3
+	cpussse3 = __builtin_cpu_supports("ssse3");
+#endif
+	reader_init();
+
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n <= 0)
+		n = 1;
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&tid, NULL, worker, NULL) != 0)
+			die("pthread_create: %s\n", strerror(errno));
+		pthread_detach(tid);
+	}
+}
+
+static struct texture *
+texture_find(unsigned long uid)
+{
+	size_t i;
+
+	for (i = 0; i < LEN(textures); i++)
+		if (textures[i].refs && textures[i].uid == uid)
+			return &textures[i];
+	return NULL;
+}
+
+static struct texture *
+texture_new(const char *path)
+{
+	static unsigned long lastuid;
+	struct texture *t;
+	size_t i;
+
+	for (i = texfree; i < LEN(textures) && textures[i].refs; i++)
+		;
+	if (i == LEN(textures))
+		return NULL;
+	t = &textures[i];
+	memset(t, 0, sizeof(*t));
+	if (!(t->path = strdup(path)))
+		return NULL;
+	texfree = i + 1;
+	t->uid = ++lastuid;
+	t->pending = 1;
+	t->opening = 1;
+	t->refs = 1;
+	if (openleft++ == 0) {
+		openstart = now();
+		opencount = 0;
+	}
+	return t;
+}
+
+static void
+texture_opened(struct texture *t)
+{
+	if (!t->opening)
+		return;
+	t->opening = 0;
+	opencount++;
+	if (--openleft == 0 && showstats)
+		err("%zu images opened in %.3f s\n", opencount, now() - openstart);
+}
+
+/* the final pixels are uploaded */
+static void
+texture_ready(struct texture *t)
+{
+	t->pending = 0;
+	if (t->stream && t->qoi) {
+		/* the evicted last frame, kept in case this one failed */
+		ramused -= t->qoisize;
+		free(t->qoi);
+		t->qoi = NULL;
+		t->qoisize = 0;
+	}
+	texture_opened(t);
+}
+
+/*
+ * The content of the texture is not shared anymore, gone is set when the
+ * texture is freed while a job may still publish its hash.
+ */
+static void
+hash_forget(unsigned long uid, int gone)
+{
+	size_t i;
+
+	pthread_mutex_lock(&loadlock);
+	for (i = 0; i < hashcount; i++) {
+		if (hashes[i].uid == uid) {
+			hashes[i] = hashes[--hashcount];
+			break;
+		}
+	}
+	if (i == hashcount && gone && hashcount < LEN(hashes)) {
+		hashes[hashcount].hash = 0;
+		hashes[hashcount].gone = 1;
+		hashes[hashcount++].uid = uid;
+	}
+	pthread_mutex_unlock(&loadlock);
+}
+
+/* the id of t is let go, the textures showing it too show nothing */
+static void
+texture_unbind(struct texture *t)
+{
+	struct texture *l;
+	size_t i;
+
+	if (t->lender) {
+		if ((l = texture_find(t->lender)))
+			l->lent--;
+		t->lender = 0;
+	} else if (t->id) {
+		for (i = 0; t->lent > 0 && i < LEN(textures); i++) {
+			if (textures[i].refs && textures[i].lender == t->uid) {
+				textures[i].id = 0;
+				textures[i].lender = 0;
+				t->lent--;
+			}
+		}
+		glDeleteTextures(1, &t->id);
+	}
+	t->id = 0;
+	t->lent = 0;
+}
+
+static void
+texture_unref(struct texture *t)
+{
+	if (--t->refs > 0)
+		return;
+	texture_opened(t);
+	texture_unbind(t);
+	texture_unpage(t);
+	texused -= t->texsize;
+	ramused -= t->qoisize;
+	free(t->qoi);
+	free(t->path);
+	free(t->delays);
+	hash_forget(t->uid, t->pending);
+	memset(t, 0, sizeof(*t));
+	if ((size_t)(t - textures) < texfree)
+		texfree = t - textures;
+}
+
+/* follow the size of the texture */
+static void
+image_fit(struct image *img)
+{
+	struct texture *t = img->tex;
+	int fitted = 0;
+
+	if (!t->width)
+		return;
+	if (img->width == 0 && img->height == 0 && img->fit > 0) {
+		if (t->width > img->fit || t->height > img->fit)
+			img->scale = img->fit / (t->width > t->height ? t->width : t->height);
+		img->posx -= (int)(t->width * img->scale) / 2;
+		img->posy -= (int)(t->height * img->scale) / 2;
+		fitted = 1;
+	} else if (img->width == 0 && img->height == 0) {
+		/* the position was the center until the size was known */
+		img->posx -= (int)t->width / 2;
+		img->posy -= (int)t->height / 2;
+	}
+	img->width = t->width;
+	img->height = t->height;
+	/* the journal knows the transform, not the fit */
+	if (fitted)
+		journal_image(img, JNL_MOVE);
+}
+
+static void
+image_remove(struct image *img)
+{
+	size_t i = img - images;
+
+	journal_image(img, JNL_REMOVE);
+	texture_unref(img->tex);
+	free((char *)img->path);
+	memmove(img, img + 1, (image_count - i - 1) * sizeof(*img));
+	image_count--;
+
+	hover_img = NULL;
+	if (focus_img == img)
+		focus_img = NULL;
+	else if (focus_img > img)
+		focus_img--;
+}
+
+/*
+ * Images of the session which failed to load, their file may be back the
+ * next time.  They are not journaled as removed and are written with the
+ * session, after the images of the board.
+ */
+static struct lost {
+	char *path;
+	int x, y;
+	float scale;
+} *lost;
+static size_t nlost, lostcap;
+
+static void
+lost_clear(void)
+{
+	while (nlost > 0)
+		free(lost[--nlost].path);
+}
+
+/* remove the images of a texture which failed to load */
+static void
+texture_drop(struct texture *t)
+{
+	struct image *img;
+	struct lost *l;
+	size_t i;
+
+	for (i = image_count; i > 0; i--) {
+		img = &images[i - 1];
+		if (img->tex != t)
+			continue;
+		if (img->key && nlost == lostcap) {
+			lostcap = lostcap ? lostcap * 2 : 16;
+			if ((l = realloc(lost, lostcap * sizeof(*l))))
+				lost = l;
+			else
+				lostcap = nlost;
+		}
+		if (img->key && nlost < lostcap && (lost[nlost].path = strdup(img->path))) {
+			lost[nlost].x = img->posx + (int)img->width / 2;
+			lost[nlost].y = img->posy + (int)img->height / 2;
+			lost[nlost++].scale = img->scale;
+		}
+		img->key = 0; /* not removed by the user */
+		image_remove(img);
+	}
+}
+
+/* the images of t use share instead, t is freed */
+static void
+texture_merge(struct texture *t, struct texture *share)
+{
+	size_t i;
+
+	for (i = 0; i < image_count; i++) {
+		if (images[i].tex != t)
+			continue;
+		images[i].tex = share;
+		share->refs++;
+		image_fit(&images[i]);
+		texture_unref(t);
+	}
+}
+
+static void
+texture_set(struct texture *t, struct texture tex, size_t w, size_t h)
+{
+	size_t i;
+
+	texture_unbind(t);
+	texture_unpage(t);
+	t->id = tex.id;
+	t->type = tex.type;
+	t->format = tex.format;
+	t->cached = tex.cached;
+	t->pyramid = tex.pyramid;
+	t->frames = tex.frames;
+	t->frame = 0;
+	t->lodbias = tex.lodbias;
+	t->pyrbase = tex.pyrbase;
+	texused += tex.texsize - t->texsize;
+	t->texsize = tex.texsize;
+	t->width = w;
+	t->height = h;
+	for (i = 0; i < image_count; i++)
+		if (images[i].tex == t)
+			image_fit(&images[i]);
+}
+
+static GLuint
+pbo_get(size_t size, size_t *cap)
+{
+	size_t i, best = pbocount;
+	GLuint id;
+
+	for (i = 0; i < pbocount; i++)
+		if (pbopool[i].size >= size
+		    && (best == pbocount || pbopool[i].size < pbopool[best].size))
+			best = i;
+	if (best < pbocount) {
+		id = pbopool[best].id;
+		*cap = pbopool[best].size;
+		pbopool[best] = pbopool[--pbocount];
+		return id;
+	}
+
+	glGenBuffers(1, &id);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, id);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	*cap = size;
+	return id;
+}
+
+static void
+pbo_put(GLuint id, size_t size)
+{
+	size_t i, min = 0;
+
+	if (pbocount < PBO_POOL) {
+		pbopool[pbocount].id = id;
+		pbopool[pbocount].size = size;
+		pbocount++;
+		return;
+	}
+	/* keep the largest buffers */
+	for (i = 1; i < pbocount; i++)
+		if (pbopool[i].size < pbopool[min].size)
+			min = i;
+	if (pbopool[min].size < size) {
+		glDeleteBuffers(1, &pbopool[min].id);
+		pbopool[min].id = id;
+		pbopool[min].size = size;
+	} else {
+		glDeleteBuffers(1, &id);
+	}
+}
+
+static void
+pbo_flush(void)
+{
+	while (pbocount > 0)
+		glDeleteBuffers(1, &pbopool[--pbocount].id);
+}
+
+static void
+job_map(struct job *job)
+{
+	size_t size = (size_t)job->width * job->height * job->channels;
+
+	if (pbomapped > 0 && pbomapped + size > PBO_MAPPED * pbobytes) {
+		job->kind = JOB_MAP;
+		queue_push(&pbowait, job);
+		return;
+	}
+	job->pbo = pbo_get(size, &job->pbosize);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, job->pbo);
+	job->dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+				    GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (!job->dst) {
+		/* decode in memory instead */
+		pbo_put(job->pbo, job->pbosize);
+		job->pbo = 0;
+	} else {
+		pbomapped += job->pbosize;
+	}
+	job->kind = JOB_DECODE;
+	loader_push_front(job);
+}
+
+/* map the buffers of the jobs waiting, as long as there is room */
+static void
+pbo_next(void)
+{
+	struct job *job;
+
+	while ((job = pbowait.head) && (pbomapped == 0 || pbomapped
+	       + (size_t)job->width * job->height * job->channels <= PBO_MAPPED * pbobytes))
+		job_map(queue_pop(&pbowait));
+}
+
+/* unmap the pixel buffer, returns 0 if its content is lost */
+static int
+job_unmap(struct job *job)
+{
+	GLboolean ret = GL_TRUE;
+
+	if (job->dst) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, job->pbo);
+		ret = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		job->dst = NULL;
+		pbomapped -= job->pbosize;
+	}
+	return ret == GL_TRUE;
+}
+
+static void
+job_release(struct job *job)
+{
+	job_unmap(job);
+	if (job->pbo)
+		pbo_put(job->pbo, job->pbosize);
+	job_free(job);
+}
+
+/* returns 1 if the pixels of a reloaded image go in place of the old ones */
+static int
+texture_fits(struct texture *t, struct job *job)
+{
+	return job->reload && t->id && !t->lender && t->type == GL_TEXTURE_2D && !t->pyramid
+		&& t->format == channels_format(job->channels)
+		&& t->width == (size_t)job->width && t->height == (size_t)job->height;
+}
+
+static void
+texture_pixels(struct texture *t, struct job *job, void *data)
+{
+	GLenum format = channels_format(job->channels);
+
+	if (!texture_fits(t, job) || job->pw != job->width || job->ph != job->height) {
+		texture_set(t, create_image(job->pw, job->ph, format,
+					GL_UNSIGNED_BYTE, data),
+				job->width, job->height);
+		return;
+	}
+	glBindTexture(t->type, t->id);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, row_alignment((size_t)job->pw * job->channels));
+	glTexSubImage2D(t->type, 0, 0, 0, job->pw, job->ph, format, GL_UNSIGNED_BYTE, data);
+}
+
+static int
+upload_pbo(struct texture *t, struct job *job)
+{
+	GLenum format = channels_format(job->channels);
+	double start;
+
+	if (!job_unmap(job)) {
+		err("%s: pixel buffer lost\n", job->name);
+		return -1;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, job->pbo);
+	start = now();
+	texture_pixels(t, job, NULL);
+	upload_stat(UP_PBO, format, (size_t)job->width * job->height, start);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	return 0;
+}
+
+/* read the file of the texture again, decoded in memory */
+static void
+texture_reread(struct texture *t)
+{
+	struct job *job = calloc(1, sizeof(*job));
+
+	t->pending = 0;
+	if (!job || !(job->name = strdup(t->path))) {
+		free(job);
+		return;
+	}
+	job->kind = JOB_LOAD;
+	job->uid = t->uid;
+	job->nopbo = 1;
+	t->pending = 1;
+	loader_push(job);
+}
+
+static void
+upload_band(struct texture *t, struct job *job)
+{
+	GLenum format = channels_format(job->channels);
+	double start;
+
+	if (job->y == 0 && !texture_fits(t, job))
+		texture_set(t, create_image(job->width, job->height,
+					format, GL_UNSIGNED_BYTE, NULL),
+				job->width, job->height);
+	glBindTexture(t->type, t->id);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, row_alignment((size_t)job->pw * job->channels));
+	start = now();
+	glTexSubImage2D(t->type, 0, 0, job->y, job->pw, job->ph,
+			format, GL_UNSIGNED_BYTE, job->data);
+	upload_stat(UP_MEMORY, format, (size_t)job->pw * job->ph, start);
+}
+
+static void
+upload_image(struct texture *t, struct job *job)
+{
+	GLenum format = channels_format(job->channels);
+	double start = now();
+
+	texture_pixels(t, job, job->data);
+	upload_stat(UP_MEMORY, format, (size_t)job->pw * job->ph, start);
+}
+
+/*
+ * Upload rows stride bytes apart, copied once to a pixel buffer, from
+ * BGRX when bgrx is set.  The texture is written in place when its size
+ * and format are the same.  Returns -1 if the buffer is lost.
+ */
+static int
+upload_rows(struct texture *t, struct job *job, const unsigned char *src,
+	    size_t stride, int bgrx)
+{
+	size_t i, x, n, cap;
+	unsigned char *dst, *p;
+	const unsigned char *s;
+	double start;
+	GLuint pbo;
+	int ret = -1, rgb = job->channels == 3;
+
+	/* most drivers repack 3 byte pixels one by one, expand them here */
+	if (rgb)
+		job->channels = 4;
+	n = (size_t)job->width * job->channels;
+	pbo = pbo_get(n * job->height, &cap);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+	dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, n * job->height,
+			       GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	for (i = 0; dst && i < (size_t)job->height; i++) {
+		p = dst + i * n;
+		s = src + i * stride;
+		if (rgb) {
+			rgb_to_rgba(p, s, job->width);
+			continue;
+		}
+		if (!bgrx) {
+			memcpy(p, s, n);
+			continue;
+		}
+		for (x = 0; x < (size_t)job->width; x++, p += 4, s += 4) {
+			p[0] = s[2];
+			p[1] = s[1];
+			p[2] = s[0];
+			p[3] = 0xff;
+		}
+	}
+	if (dst && glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE) {
+		job->reload = 1;
+		start = now();
+		texture_pixels(t, job, NULL);
+		upload_stat(UP_PBO, channels_format(job->channels),
+			    (size_t)job->width * job->height, start);
+		texture_ready(t);
+		ret = 0;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	pbo_put(pbo, cap);
+	return ret;
+}
+
+/* read back a texture as RGBA */
+static int
+texture_read(struct texture *t, struct job *job)
+{
+	GLenum status;
+
+	if (!evictfbo)
+		glGenFramebuffers(1, &evictfbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, evictfbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, t->type, t->id, 0);
+	status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	if (status == GL_FRAMEBUFFER_COMPLETE) {
+		/* into a buffer, not to wait for the pixels here */
+		job->pbo = pbo_get((size_t)t->width * t->height * 4, &job->pbosize);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, job->pbo);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glReadPixels(0, 0, t->width, t->height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		job->sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, t->type, 0, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	return job->sync ? 0 : -1;
+}
+
+/* the copy of an evicted texture is lost */
+static void
+texture_lost(struct texture *t)
+{
+	t->pending = 0;
+	if (!t->stream || t->id || t->qoi)
+		return;
+	/* its path is no file, the images go */
+	err("%s: Evicted image lost\n", t->path);
+	texture_drop(t);
+}
+
+/* the pixels read back are handed to a worker once they are there */
+static void
+readback_poll(void)
+{
+	struct texture *t;
+	struct job *job;
+	GLenum ret;
+
+	while ((job = readbacks.head)) {
+		ret = glClientWaitSync(job->sync, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		if (ret == GL_TIMEOUT_EXPIRED)
+			break;
+		queue_pop(&readbacks);
+		glDeleteSync(job->sync);
+		job->sync = NULL;
+		if (ret != GL_WAIT_FAILED) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, job->pbo);
+			job->dst = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+						    (size_t)job->width * job->height * 4,
+						    GL_MAP_READ_BIT);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		}
+		if (job->dst) {
+			pbomapped += job->pbosize;
+			loader_push(job);
+			continue;
+		}
+		/* lost, read from the file again once back in view */
+		if ((t = texture_find(job->uid)))
+			texture_lost(t);
+		job_release(job);
+	}
+}
+
+/*
+ * Free a texture, the ones not in the cache are read back to be
+ * compressed by a worker and kept in memory.
+ */
+static void
+texture_evict(struct texture *t)
+{
+	struct job *job = NULL;
+
+	/* animations are decoded again */
+	if (!t->cached && t->frames < 2 && (job = calloc(1, sizeof(*job)))) {
+		job->kind = JOB_EVICT;
+		job->uid = t->uid;
+		job->width = t->width;
+		job->height = t->height;
+		job->channels = format_channels(t->format);
+		if (texture_read(t, job) == 0) {
+			t->pending = 1;
+			queue_push(&readbacks, job);
+		} else {
+			job_release(job);
+			job = NULL;
+		}
+	}
+	if (!job && t->stream)
+		return; /* it has no file to be read again from */
+	texture_unbind(t);
+	texture_unpage(t);
+	t->advised = 0;
+	texused -= t->texsize;
+	t->texsize = 0;
+}
+
+static int
+seen_cmp(const void *a, const void *b)
+{
+	const struct texture *p = *(struct texture *const *)a;
+	const struct texture *q = *(struct texture *const *)b;
+
+	return p->seen < q->seen ? -1 : p->seen > q->seen;
+}
+
+/* evict the textures out of view for the longest time */
+static void
+texture_trim(void)
+{
+	static struct texture *lru[LEN(textures)];
+	size_t i, n = 0;
+
+	if (texused <= texcap)
+		return;
+	for (i = 0; i < LEN(textures); i++) {
+		struct texture *p = &textures[i];
+		if (p->refs && p->id && !p->pending && p->seen != frameno)
+			lru[n++] = p;
+	}
+	qsort(lru, n, sizeof(*lru), seen_cmp);
+	/* the rest is in view */
+	for (i = 0; i < n && texused > texcap; i++)
+		texture_evict(lru[i]);
+}
+
+static void
+ram_trim(void)
+{
+	struct texture *t;
+	size_t i;
+
+	while (ramused > ramcap) {
+		t = NULL;
+		for (i = 0; i < LEN(textures); i++)
+			if (textures[i].qoi && !textures[i].stream
+			    && (!t || textures[i].seen < t->seen))
+				t = &textures[i];
+		if (!t)
+			break;
+		ramused -= t->qoisize;
+		free(t->qoi);
+		t->qoi = NULL;
+		t->qoisize = 0;
+	}
+}
+
+/* upload again an evicted texture */
+static void
+texture_restore(struct texture *t)
+{
+	struct job *job;
+
+	if (t->stream && !t->qoi)
+		return; /* its path is no file */
+	job = calloc(1, sizeof(*job));
+	if (job)
+		job->name = strdup(t->path);
+	if (!job || !job->name) {
+		free(job);
+		return;
+	}
+	job->uid = t->uid;
+	t->pending = 1;
+	if (!t->qoi) {
+		/* decode the file again, or read its cached copy */
+		job->kind = JOB_LOAD;
+		loader_push(job);
+		return;
+	}
+
+	/* a single QOI decode, into a pixel buffer when small enough */
+	job->qoif = 1;
+	job->file = t->qoi;
+	job->len = t->qoisize;
+	job->width = job->pw = t->width;
+	job->height = job->ph = t->height;
+	job->channels = 4;
+	ramused -= t->qoisize;
+	t->qoi = NULL;
+	t->qoisize = 0;
+	if ((size_t)job->width * job->height * job->channels <= pbobytes) {
+		job_map(job);
+	} else {
+		job->kind = JOB_DECODE;
+		loader_push(job);
+	}
+}
+
+/* lay the images of a directory on the grid of its import */
+static void
+import_found(struct job *job)
+{
+	struct import *imp = job->import;
+	size_t i, n;
+	int x, y, left;
+
+	for (i = 0; i < job->count; i++) {
+		if (image_count >= LEN(images)) {
+			err("%s: Cannot open image, too many open\n", job->names[i]);
+			break;
+		}
+		n = imp->count++;
+		x = imp->x + (int)(n % gridcolumns) * (int)gridcell;
+		y = imp->y + (int)(n / gridcolumns) * (int)gridcell;
+		n = image_count;
+		keyless = imp->session;
+		load_file(job->names[i], x, y, 1.0);
+		keyless = 0;
+		if (image_count > n)
+			images[n].fit = gridcell;
+	}
+
+	pthread_mutex_lock(&loadlock);
+	left = --imp->scans;
+	pthread_mutex_unlock(&loadlock);
+	if (left > 0)
+		return;
+	/* the line of the directory becomes the lines of its images */
+	if (imp->session && journal.fd >= 0)
+		write_session(session_file);
+	free(imp);
+}
+
+/* open the images found under a directory, centered on x, y */
+static void
+import_dir(const char *name, int x, int y, int session)
+{
+	struct import *imp;
+	struct job *job;
+
+	imp = calloc(1, sizeof(*imp));
+	job = calloc(1, sizeof(*job));
+	if (job)
+		job->name = strdup(name);
+	if (!imp || !job || !job->name) {
+		err("%s: %s\n", name, strerror(errno));
+		free(imp);
+		if (job)
+			free(job->name);
+		free(job);
+		return;
+	}
+	imp->x = x + gridcell / 2;
+	imp->y = y + gridcell / 2;
+	imp->scans = 1;
+	imp->session = session;
+	job->kind = JOB_SCAN;
+	job->import = imp;
+	loader_push(job);
+}
+
+/* returns 1 if the view moved by dx, dy on the board reaches the image */
+static int
+img_ahead(struct image *i, float dx, float dy)
+{
+	float hw = width / 2 / zoom;
+	float hh = height / 2 / zoom;
+	float x0 = -orgx - hw + (dx < 0 ? dx : 0);
+	float x1 = -orgx + hw + (dx > 0 ? dx : 0);
+	float y0 = -orgy - hh + (dy < 0 ? dy : 0);
+	float y1 = -orgy + hh + (dy > 0 ? dy : 0);
+
+	return i->posx + i->width * i->scale >= x0 && i->posx < x1
+		&& i->posy + i->height * i->scale >= y0 && i->posy < y1;
+}
+
+/* have the file of an evicted texture read ahead by the kernel */
+static void
+texture_advise(struct texture *t)
+{
+	struct job *job = calloc(1, sizeof(*job));
+
+	if (job)
+		job->name = strdup(t->path);
+	if (!job || !job->name) {
+		free(job);
+		return;
+	}
+	job->kind = JOB_ADVISE;
+	job->uid = t->uid;
+	t->advised = 1;
+	loader_push(job);
+}
+
+/*
+ * While panning, the textures the view reaches within prefetchahead
+ * seconds are uploaded again, and count as seen so they are not
+ * evicted, the files of the ones reached within twice as long are read
+ * ahead.
+ */
+static void
+prefetch(void)
+{
+	float dx = panvx * prefetchahead;
+	float dy = panvy * prefetchahead;
+	struct texture *t;
+	size_t i;
+
+	if (dx == 0 && dy == 0)
+		return;
+	for (i = 0; i < image_count; i++) {
+		t = images[i].tex;
+		if (t->seen == frameno || !t->width || t->pending)
+			continue;
+		if (img_ahead(&images[i], dx, dy)) {
+			t->seen = frameno;
+			if (!t->id)
+				texture_restore(t);
+		} else if (!t->id && !t->qoi && !t->advised
+			   && img_ahead(&images[i], 2 * dx, 2 * dy)) {
+			texture_advise(t);
+		}
+	}
+}
+
+/* upload the jobs done by the workers, returns the number of jobs */
+static int
+loader_poll(void)
+{
+	struct texture *t, *share;
+	struct queue q;
+	struct job *job;
+	int count = 0;
+
+	pthread_mutex_lock(&loadlock);
+	q = done;
+	done.head = done.tail = NULL;
+	pthread_mutex_unlock(&loadlock);
+
+	while ((job = queue_pop(&q))) {
+		count++;
+		if (job->parent) {
+			/* let the decoder of the band go on */
+			pthread_mutex_lock(&loadlock);
+			job->parent->inflight--;
+			pthread_cond_broadcast(&bandcond);
+			pthread_mutex_unlock(&loadlock);
+		}
+		if (job->kind == JOB_FOUND) {
+			import_found(job);
+			job_free(job);
+			continue;
+		}
+		if (job->kind == JOB_SAVED) {
+			session_saved(job);
+			job_free(job);
+			continue;
+		}
+		t = texture_find(job->uid);
+		if (!t) {
+			/* drop what it published, or its gone entry */
+			hash_forget(job->uid, 0);
+			job_release(job);
+			continue;
+		}
+		switch (job->kind) {
+		case JOB_MAP:
+			job_map(job);
+			continue;
+		case JOB_UPLOAD:
+			if (upload_pbo(t, job) == 0)
+				texture_ready(t);
+			else
+				texture_reread(t);
+			break;
+		case JOB_PREVIEW:
+		case JOB_IMAGE:
+			upload_image(t, job);
+			if (job->kind == JOB_IMAGE)
+				texture_ready(t);
+			if (job->kind == JOB_IMAGE
+			    && job_wants_pyramid(job, job->width, job->height)) {
+				/* the pixels are kept to write the pyramid */
+				job->kind = JOB_PYRAMID;
+				loader_push(job);
+				continue;
+			}
+			if (job->kind == JOB_IMAGE
+			    && job_wants_etc(job, job->width, job->height)) {
+				/* swapped for the compressed image once encoded */
+				job->kind = JOB_COMPRESS;
+				loader_push(job);
+				continue;
+			}
+			break;
+		case JOB_ANIM:
+			texture_set(t, create_image_array(job->width, job->height,
+						job->frames, job->data),
+					job->width, job->height);
+			free(t->delays);
+			t->delays = job->delays;
+			job->delays = NULL;
+			t->next = now() + frame_delay(t);
+			texture_ready(t);
+			break;
+		case JOB_TILES:
+			texture_set(t, create_image_pyramid(&job->pyr),
+					job->pyr.hdr->width, job->pyr.hdr->height);
+			texture_page(t, &job->pyr);
+			texture_ready(t);
+			break;
+		case JOB_ETC:
+			texture_set(t, create_image_etc(&job->etc),
+					job->etc.hdr->width, job->etc.hdr->height);
+			texture_ready(t);
+			break;
+		case JOB_BAND:
+			upload_band(t, job);
+			break;
+		case JOB_DONE:
+			texture_ready(t);
+			break;
+		case JOB_STORE:
+			t->pending = 0;
+			if (job->file && !t->id) {
+				t->qoi = job->file;
+				t->qoisize = job->len;
+				job->file = NULL;
+				ramused += t->qoisize;
+				ram_trim();
+			} else {
+				texture_lost(t);
+			}
+			break;
+		case JOB_SHARE:
+			if ((share = texture_find(job->shareuid))) {
+				/* nothing of it in flight, its hash is forgotten */
+				t->pending = 0;
+				texture_merge(t, share);
+				break;
+			}
+			/* the owner of the content went away meanwhile */
+			hash_forget(job->shareuid, 0);
+			job->kind = JOB_LOAD;
+			loader_push(job);
+			continue;
+		default:
+			if (job->stream && job->reload && (t->id || t->qoi)) {
+				/* the last good frame stays on the board */
+				err("%s: Fail to load frame, last one kept\n", job->name);
+				t->pending = 0;
+				break;
+			}
+			err("%s: Fail to load image\n", job->name);
+			t->pending = 0;
+			texture_drop(t);
+			break;
+		}
+		job_release(job);
+	}
+	pbo_next();
+	return count;
+}
+
+/*
+ * The directories of the images and of the session file are watched, a
+ * file written or moved in place is reloaded once it stays unchanged for
+ * reloaddelay seconds.
+ */
+static int notifyfd = -1;
+static struct watch {
+	int wd;
+	char *dir;
+} *watches;
+static size_t watchcount;
+static double sessionreloadat;
+static unsigned long sessionrank; /* of the last image read from the session */
+static struct stat sessionst; /* of the session file as last written */
+static int sessionsync;
+
+/* splits path in its directory and its name, returns the name */
+static const char *
+path_dir(const char *path, char *dir, size_t size)
+{
+	const char *s = strrchr(path, '/');
+	size_t n;
+
+	if (!s) {
+		snprintf(dir, size, ".");
+		return path;
+	}
+	n = s == path ? 1 : (size_t)(s - path);
+	snprintf(dir, size, "%.*s", (int)n, path);
+	return s + 1;
+}
+
+static void
+notify_init(void)
+{
+#ifdef __linux__
+	if (reloaddelay >= 0)
+		notifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+}
+
+static void
+watch_path(const char *path)
+{
+#ifdef __linux__
+	char dir[PATH_MAX];
+	struct watch *w;
+	size_t i;
+	int wd;
+
+	if (notifyfd < 0)
+		return;
+	path_dir(path, dir, sizeof(dir));
+	for (i = 0; i < watchcount; i++)
+		if (strcmp(watches[i].dir, dir) == 0)
+			return;
+	wd = inotify_add_watch(notifyfd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (wd < 0) {
+		err("%s: %s\n", dir, strerror(errno));
+		return;
+	}
+	if (!(w = realloc(watches, (watchcount + 1) * sizeof(*w))))
+		return;
+	watches = w;
+	watches[watchcount].wd = wd;
+	if ((watches[watchcount].dir = strdup(dir)))
+		watchcount++;
+#else
+	(void)path;
+#endif
+}
+
+/* returns 1 if path is the file name of the directory dir */
+static int
+path_is(const char *path, const char *dir, const char *name)
+{
+	char d[PATH_MAX];
+
+	return strcmp(path_dir(path, d, sizeof(d)), name) == 0 && strcmp(d, dir) == 0;
+}
+
+static void
+notify_read(void)
+{
+#ifdef __linux__
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	struct inotify_event *ev;
+	double at = now() + reloaddelay;
+	const char *dir;
+	ssize_t n, off;
+	size_t i;
+
+	while ((n = read(notifyfd, u.buf, sizeof(u.buf))) > 0) {
+		for (off = 0; off < n; off += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)(u.buf + off);
+			for (i = 0, dir = NULL; i < watchcount && !dir; i++)
+				if (watches[i].wd == ev->wd)
+					dir = watches[i].dir;
+			if (!dir || !ev->len)
+				continue;
+			if (session_file && path_is(session_file, dir, ev->name))
+				sessionreloadat = at;
+			for (i = 0; i < image_count; i++)
+				if (!images[i].tex->stream
+				    && path_is(images[i].path, dir, ev->name))
+					images[i].reloadat = at;
+		}
+	}
+#endif
+}
+
+/* returns the time of the next reload, 0 if none */
+static double
+reload_next(void)
+{
+	double at = sessionreloadat;
+	size_t i;
+
+	for (i = 0; i < image_count; i++)
+		if (images[i].reloadat && (!at || images[i].reloadat < at))
+			at = images[i].reloadat;
+	return at;
+}
+
+/* decode again the file of the images of path */
+static void
+image_reload(const char *path)
+{
+	struct texture *t = NULL, *n;
+	struct job *job;
+	size_t i, j;
+
+	for (i = 0; i < image_count; i++) {
+		if (strcmp(images[i].path, path) != 0)
+			continue;
+		images[i].reloadat = 0;
+		t = images[i].tex;
+		for (j = 0; j < image_count; j++)
+			if (images[j].tex == t && strcmp(images[j].path, path) != 0)
+				break;
+		if (j == image_count)
+			continue;
+
+		/* the images of other paths keep the old content, shown by
+		 * the images of path too until the new one is set */
+		if (!(n = texture_new(path)))
+			return;
+		n->refs = 0;
+		if (t->id && !t->lender) {
+			n->id = t->id;
+			n->type = t->type;
+			n->format = t->format;
+			n->frame = t->frame;
+			n->lender = t->uid;
+			t->lent++;
+		}
+		for (j = 0; j < image_count; j++) {
+			if (images[j].tex == t && strcmp(images[j].path, path) == 0) {
+				images[j].tex = n;
+				n->refs++;
+				t->refs--;
+			}
+		}
+		t = n;
+		t->pending = 0;
+	}
+	if (!t)
+		return;
+	if (t->pending) {
+		/* let the job on its way land first */
+		for (i = 0; i < image_count; i++)
+			if (images[i].tex == t)
+				images[i].reloadat = now() + reloaddelay;
+		return;
+	}
+
+	hash_forget(t->uid, 0);
+	ramused -= t->qoisize;
+	free(t->qoi);
+	t->qoi = NULL;
+	t->qoisize = 0;
+	if (!t->id && t->width)
+		return; /* read from the file once back in view */
+
+	job = calloc(1, sizeof(*job));
+	if (job)
+		job->name = strdup(path);
+	if (!job || !job->name) {
+		free(job);
+		return;
+	}
+	job->kind = JOB_LOAD;
+	job->uid = t->uid;
+	job->reload = 1;
+	t->pending = 1;
+	loader_push(job);
+}
+
+/*
+ * The images open by their path while the session file is read again,
+ * so that each of its records finds its image at once.  Holds the index
+ * of the image plus one, 0 is a free slot.
+ */
+static size_t *pathtab;
+static size_t pathmask;
+
+static void
+pathtab_build(void)
+{
+	size_t i, n = 16, h;
+
+	while (n < image_count * 2)
+		n *= 2;
+	if (!(pathtab = calloc(n, sizeof(*pathtab))))
+		return; /* looked up one by one */
+	pathmask = n - 1;
+	for (i = 0; i < image_count; i++) {
+		h = fnv1a(FNV_OFFSET, images[i].path, strlen(images[i].path)) & pathmask;
+		while (pathtab[h])
+			h = (h + 1) & pathmask;
+		pathtab[h] = i + 1;
+	}
+}
+
+/* the first image of path not yet placed */
+static struct image *
+pathtab_find(const char *path)
+{
+	struct image *img;
+	size_t h, i;
+
+	if (!pathtab) {
+		for (i = 0; i < image_count; i++)
+			if (!images[i].mark && strcmp(images[i].path, path) == 0)
+				return &images[i];
+		return NULL;
+	}
+	h = fnv1a(FNV_OFFSET, path, strlen(path)) & pathmask;
+	for (; pathtab[h]; h = (h + 1) & pathmask) {
+		img = &images[pathtab[h] - 1];
+		if (!img->mark && strcmp(img->path, path) == 0)
+			return img;
+	}
+	return NULL;
+}
+
+/* bring the board in line with the session file */
+static void
+session_reload(void)
+{
+	struct stat st;
+	size_t i;
+
+	sessionreloadat = 0;
+	if (stat(session_file, &st) < 0)
+		return;
+	if (st.st_ino == sessionst.st_ino && st.st_size == sessionst.st_size
+	    && st.st_mtim.tv_sec == sessionst.st_mtim.tv_sec
+	    && st.st_mtim.tv_nsec == sessionst.st_mtim.tv_nsec)
+		return; /* written by us */
+	sessionst = st;
+
+	for (i = 0; i < image_count; i++)
+		images[i].mark = 0;
+	sessionsync = 1;
+	lost_clear(); /* read again with the file */
+	pathtab_build();
+	read_session(session_file);
+	free(pathtab);
+	pathtab = NULL;
+	for (i = image_count; i > 0; i--)
+		if (!images[i - 1].mark)
+			image_remove(&images[i - 1]);
+	sessionsync = 0;
+	/* the keys are the ranks in the new session file */
+	journal_reset();
+}
+
+static void
+reload_due(void)
+{
+	double t = now();
+	size_t i;
+
+	if (sessionreloadat && sessionreloadat <= t)
+		session_reload();
+	for (i = 0; i < image_count; i++)
+		if (images[i].reloadat && images[i].reloadat <= t)
+			image_reload(images[i].path);
+}
+
+/* ids grow with the images, the array is kept in order */
+static struct image *
+image_lookup(unsigned long id)
+{
+	size_t lo = 0, hi = image_count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (images[mid].id == id)
+			return &images[mid];
+		if (images[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/* the image shows up centered on x, y once the loader gives its size */
+static struct image *
+image_add(struct texture *t, const char *name, int x, int y, float scale)
+{
+	static unsigned long lastid;
+	struct image *img = &images[image_count++];
+
+	memset(img, 0, sizeof(*img));
+	img->id = ++lastid;
+	img->tex = t;
+	img->path = strdup(name);
+	img->scale = scale;
+	img->posx = x;
+	img->posy = y;
+	if (!t->stream && !keyless) {
+		img->key = ++lastkey;
+		journal_image(img, JNL_ADD);
+	}
+	return img;
+}
+
+/* open a file known not to be a directory */
+static void
+load_file(const char *name, int x, int y, float scale)
+{
+	struct texture *t;
+	struct job *job;
+
+	if (image_count >= LEN(images)) {
+		err("%s: Cannot open image, too many open\n", name);
+		return;
+	}
+
+	job = calloc(1, sizeof(*job));
+	if (job)
+		job->name = strdup(name);
+	if (!job || !job->name || !(t = texture_new(name))) {
+		err("%s: %s\n", name, strerror(errno));
+		if (job)
+			free(job->name);
+		free(job);
+		return;
+	}
+	job->kind = JOB_LOAD;
+	job->uid = t->uid;
+	watch_path(name);
+	image_add(t, name, x, y, scale);
+	loader_push(job);
+}
+
+static void
+load_at(const char *name, int x, int y, float scale)
+{
+	struct stat st;
+
+	if (name == NULL)
+		return;
+	if (stat(name, &st) == 0 && S_ISDIR(st.st_mode))
+		import_dir(name, x, y, 0);
+	else
+		load_file(name, x, y, scale);
+}
+
+/*
+ * Images read one after the other from a pipe, PNG or QOI.  QOI frames
+ * are decoded on the fly as their bytes arrive, PNG frames are cut at
+ * their IEND chunk and decoded by the workers.  One frame is decoded at
+ * a time and a single one waits behind it: a newer frame takes its place
+ * when frames replace each other, the stream is not read while it waits
+ * otherwise.  Frames larger than streambytes are skipped.
+ */
+#define STREAM_READ (1024 * 1024) /* read at most at once */
+
+enum stream_state {
+	STREAM_MAGIC,	/* start of a frame */
+	STREAM_PNG,	/* chunks of a PNG frame */
+	STREAM_QOI,	/* pixels of a QOI frame */
+	STREAM_BAD,	/* unknown data, dropped until the next magic */
+};
+
+static struct {
+	int fd;
+	const char *name;
+	int fifo; /* opened again when its writer is gone */
+	enum stream_state state;
+	unsigned char *buf;
+	size_t len, cap;
+	size_t off; /* of the next chunk of the PNG frame */
+	size_t skip; /* bytes left to drop */
+	int drop; /* the frame is too large */
+	struct qoidec dec;
+	unsigned char *px; /* pixels of the QOI frame */
+	size_t npx, pos; /* pixels px holds, pixels decoded */
+	unsigned long uid; /* texture of the last frame */
+	unsigned long busyuid; /* texture of the frame being decoded */
+	struct job *next; /* waiting behind it */
+	struct import grid; /* frames laid out when not replaced */
+} stream = { .fd = -1 };
+
+static uint32_t
+be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* "-" is the standard input */
+static int
+stream_open(const char *name)
+{
+	struct stat st;
+
+	stream.name = name;
+	if (strcmp(name, "-") == 0)
+		stream.fd = dup(STDIN_FILENO);
+	else
+		stream.fd = open(name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (stream.fd < 0)
+		return -1;
+	stream.fifo = strcmp(name, "-") != 0 && fstat(stream.fd, &st) == 0
+		&& S_ISFIFO(st.st_mode);
+	fcntl(stream.fd, F_SETFL, fcntl(stream.fd, F_GETFL) | O_NONBLOCK);
+	fcntl(stream.fd, F_SETFD, FD_CLOEXEC);
+	stream.grid.x = gridcell / 2;
+	stream.grid.y = gridcell / 2;
+	return 0;
+}
+
+/* returns 1 while a frame waits and the next ones have to wait too */
+static int
+stream_full(void)
+{
+	return !streamreplace && stream.next;
+}
+
+static void stream_parse(void);
+
+static void
+stream_drop(size_t n)
+{
+	stream.len -= n;
+	memmove(stream.buf, stream.buf + n, stream.len);
+}
+
+/* show the frame on the board, now or once uploaded */
+static void
+stream_send(struct job *job)
+{
+	struct texture *t = NULL;
+	struct image *img;
+	size_t n;
+	int x, y;
+
+	if (streamreplace)
+		t = texture_find(stream.uid);
+	if (!t) {
+		if (image_count >= LEN(images) || !(t = texture_new(stream.name))) {
+			err("%s: Cannot open image, too many open\n", stream.name);
+			job_free(job);
+			return;
+		}
+		t->stream = 1;
+		if (streamreplace) {
+			image_add(t, stream.name, 0, 0, 1.0);
+		} else {
+			n = stream.grid.count++;
+			x = stream.grid.x + (int)(n % gridcolumns) * (int)gridcell;
+			y = stream.grid.y + (int)(n / gridcolumns) * (int)gridcell;
+			img = image_add(t, stream.name, x, y, 1.0);
+			img->fit = gridcell;
+		}
+		stream.uid = t->uid;
+	} else {
+		/* in place of the last frame, kept until it is uploaded */
+		job->reload = 1;
+	}
+	job->uid = t->uid;
+	t->pending = 1;
+	if (job->kind == JOB_IMAGE) {
+		upload_image(t, job);
+		texture_ready(t);
+		job_free(job);
+		return;
+	}
+	stream.busyuid = t->uid;
+	loader_push(job);
+}
+
+static void
+stream_frame(struct job *job)
+{
+	if (!stream.busyuid) {
+		stream_send(job);
+		return;
+	}
+	if (stream.next)
+		job_free(stream.next);
+	stream.next = job;
+}
+
+/* send the waiting frame once the last one is uploaded */
+static void
+stream_landed(void)
+{
+	struct texture *t;
+	struct job *job;
+
+	if (!stream.busyuid)
+		return;
+	t = texture_find(stream.busyuid);
+	if (t && t->pending)
+		return;
+	stream.busyuid = 0;
+	if ((job = stream.next)) {
+		stream.next = NULL;
+		stream_send(job);
+		stream_parse();
+	}
+}
+
+static struct job *
+stream_job(void)
+{
+	struct job *job = calloc(1, sizeof(*job));
+
+	if (job)
+		job->name = strdup(stream.name);
+	if (!job || !job->name) {
+		err("%s: %s\n", stream.name, strerror(errno));
+		free(job);
+		return NULL;
+	}
+	job->stream = 1;
+	return job;
+}
+
+/* a whole PNG frame is at the start of the buffer */
+static void
+stream_png(size_t len)
+{
+	struct job *job = stream_job();
+
+	if (job && (job->file = malloc(len))) {
+		memcpy(job->file, stream.buf, len);
+		job->len = len;
+		job->kind = JOB_LOAD;
+		stream_frame(job);
+	} else if (job) {
+		job_free(job);
+	}
+	stream_drop(len);
+}
+
+/* the pixels of a QOI frame are all decoded */
+static void
+stream_qoi(void)
+{
+	struct job *job = stream_job();
+
+	if (job) {
+		job->kind = JOB_IMAGE;
+		job->qoif = 1;
+		job->data = stream.px;
+		job->width = job->pw = stream.dec.desc.width;
+		job->height = job->ph = stream.dec.desc.height;
+		job->channels = stream.dec.channels;
+		stream.px = NULL;
+		stream_frame(job);
+	}
+}
+
+/*
+ * Drops the bytes up to the next PNG or QOI magic after the start of the
+ * buffer, returns 0 if none is read yet.  The last bytes are kept in case
+ * they are the start of one.
+ */
+static int
+stream_resync(void)
+{
+	size_t i;
+
+	for (i = 1; i + 8 <= stream.len; i++) {
+		if (memcmp(stream.buf + i, "\x89PNG\r\n\x1a\n", 8) == 0
+		    || memcmp(stream.buf + i, "qoif", 4) == 0) {
+			stream_drop(i);
+			return 1;
+		}
+	}
+	if (i > 1)
+		stream_drop(i - 1);
+	return 0;
+}
+
+/* parse the bytes read, as far as they go */
+static void
+stream_parse(void)
+{
+	size_t n, left, used, px;
+	unsigned char *out;
+	int end;
+
+	for (;;) {
+		if (stream.skip) {
+			n = stream.skip < stream.len ? stream.skip : stream.len;
+			stream_drop(n);
+			stream.skip -= n;
+			if (stream.skip)
+				return;
+		}
+		switch (stream.state) {
+		case STREAM_MAGIC:
+			if (stream.len < 14 || stream_full())
+				return;
+			if (memcmp(stream.buf, "\x89PNG\r\n\x1a\n", 8) == 0) {
+				stream.state = STREAM_PNG;
+				stream.off = 8;
+			} else if ((n = qoidec_init(&stream.dec, stream.buf, stream.len, 4))) {
+				stream_drop(n);
+				stream.pos = 0;
+				stream.npx = (size_t)stream.dec.desc.width * stream.dec.desc.height;
+				if (stream.npx * stream.dec.channels > streambytes) {
+					/* decoded a few rows at a time and dropped */
+					err("%s: Frame too large, skipped\n", stream.name);
+					stream.drop = 1;
+					stream.npx = (size_t)stream.dec.desc.width * 16;
+				}
+				stream.px = malloc(stream.npx * stream.dec.channels);
+				stream.state = stream.px ? STREAM_QOI : STREAM_BAD;
+				if (!stream.px)
+					err("%s: %s\n", stream.name, strerror(errno));
+			} else {
+				err("%s: Unknown image format\n", stream.name);
+				stream.state = STREAM_BAD;
+			}
+			break;
+		case STREAM_PNG:
+			if (stream.len < stream.off + 8)
+				return;
+			n = 12 + (size_t)be32(stream.buf + stream.off);
+			end = memcmp(stream.buf + stream.off + 4, "IEND", 4) == 0;
+			if (stream.drop || stream.off + n > streambytes) {
+				/* what is read so far and the rest of it */
+				if (!stream.drop)
+					err("%s: Frame too large, skipped\n", stream.name);
+				stream.skip = stream.off + n;
+				stream.off = 0;
+				stream.drop = !end;
+				if (end)
+					stream.state = STREAM_MAGIC;
+				break;
+			}
+			if (stream.len < stream.off + n)
+				return;
+			stream.off += n;
+			if (end) {
+				stream_png(stream.off);
+				stream.state = STREAM_MAGIC;
+			}
+			break;
+		case STREAM_QOI:
+			n = (size_t)stream.dec.desc.width * stream.dec.desc.height;
+			left = n - stream.pos;
+			out = stream.px;
+			if (!stream.drop)
+				out += stream.pos * stream.dec.channels;
+			else if (left > stream.npx)
+				left = stream.npx;
+			used = qoidec_pixels(&stream.dec, stream.buf, stream.len, out, left, &px);
+			stream_drop(used);
+			stream.pos += px;
+			if (stream.pos < n) {
+				if (px == 0)
+					return;
+				break;
+			}
+			if (!stream.drop)
+				stream_qoi();
+			free(stream.px);
+			stream.px = NULL;
+			stream.drop = 0;
+			/* the end marker */
+			stream.skip = 8;
+			stream.state = STREAM_MAGIC;
+			break;
+		case STREAM_BAD:
+			if (!stream_resync())
+				return;
+			stream.state = STREAM_MAGIC;
+			break;
+		}
+	}
+}
+
+/* returns 1 if the stream is to be read */
+static int
+stream_wants(void)
+{
+	return stream.fd >= 0 && !stream_full();
+}
+
+static void
+stream_read(void)
+{
+	size_t total = 0;
+	ssize_t n = -1;
+
+	while (total < STREAM_READ && stream_wants()) {
+		if (stream.len == stream.cap) {
+			size_t cap = stream.cap ? stream.cap * 2 : 64 * 1024;
+			unsigned char *buf;
+
+			if (cap > streambytes && streambytes > stream.cap)
+				cap = streambytes;
+			if (!(buf = realloc(stream.buf, cap))) {
+				err("%s: %s\n", stream.name, strerror(errno));
+				return;
+			}
+			stream.buf = buf;
+			stream.cap = cap;
+		}
+		n = read(stream.fd, stream.buf + stream.len, stream.cap - stream.len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno != EAGAIN)
+			err("%s: %s\n", stream.name, strerror(errno));
+		if (n < 0)
+			return;
+		if (n == 0)
+			break;
+		stream.len += n;
+		total += n;
+		stream_parse();
+	}
+	if (n != 0)
+		return;
+
+	/* the end of the stream */
+	if (stream.state != STREAM_BAD && (stream.state != STREAM_MAGIC || stream.len))
+		err("%s: Last frame truncated\n", stream.name);
+	free(stream.px);
+	stream.px = NULL;
+	stream.len = stream.skip = 0;
+	stream.drop = 0;
+	stream.state = STREAM_MAGIC;
+	close(stream.fd);
+	stream.fd = -1;
+	/* wait for the next writer */
+	if (stream.fifo && stream_open(stream.name) < 0)
+		err("%s: %s\n", stream.name, strerror(errno));
+}
+
+static void
+resize(int w, int h)
+{
+	width  = (w < 0) ? 0 : w;
+	height = (h < 0) ? 0 : h;
+}
+
+static void
+zoomreset(void)
+{
+	zoom = 1;
+}
+
+static void
+saveboard(void)
+{
+	write_session(session_file);
+}
+
+static void
+toggleshape(void)
+{
+	customshape = !customshape;
+}
+
+/*
+ * Undo history of the moves and scales of the images, a ring of undosteps
+ * deltas, the oldest are dropped.  A drag makes a single step, from the
+ * transform of the image when the button went down to the one when it
+ * went up.  An arrange makes a single step too, with the moves of all
+ * the images it packed.
+ */
+struct undomove {
+	unsigned long id; /* of the image */
+	int dx, dy;
+};
+
+static struct undostep {
+	unsigned long id; /* of the image */
+	int dx, dy;
+	float from, to; /* scale */
+	struct undomove *moves; /* of an arrange, in place of the above */
+	size_t nmoves;
+} *undoring;
+static size_t undofirst, undocount, undodone;
+static struct {
+	unsigned long id;
+	int posx, posy;
+	float scale;
+} dragged;
+
+static struct undostep *
+undo_step(size_t i)
+{
+	return &undoring[(undofirst + i) % undosteps];
+}
+
+static void arrange_finish(void);
+
+/* an image is grabbed, its transform is kept to undo the drag */
+static void
+undo_begin(struct image *img)
+{
+	arrange_finish();
+	dragged.id = img->id;
+	dragged.posx = img->posx;
+	dragged.posy = img->posy;
+	dragged.scale = img->scale;
+}
+
+static void
+undo_free(struct undostep *u)
+{
+	free(u->moves);
+	memset(u, 0, sizeof(*u));
+}
+
+/* returns the step to fill in after the last one done */
+static struct undostep *
+undo_new(void)
+{
+	size_t i;
+
+	if (undosteps == 0)
+		return NULL;
+	if (!undoring && !(undoring = calloc(undosteps, sizeof(*undoring))))
+		return NULL;
+	/* the steps undone are lost */
+	for (i = undodone; i < undocount; i++)
+		undo_free(undo_step(i));
+	undocount = undodone;
+	if (undocount == undosteps) {
+		undo_free(undo_step(0));
+		undofirst = (undofirst + 1) % undosteps;
+		undocount--;
+	}
+	undodone = ++undocount;
+	return undo_step(undocount - 1);
+}
+
+/* the drag is over, what it changed is a step */
+static void
+undo_push(struct image *img)
+{
+	struct undostep *u;
+
+	if (img->id != dragged.id)
+		return;
+	if (img->posx == dragged.posx && img->posy == dragged.posy
+	    && img->scale == dragged.scale)
+		return;
+	if ((u = undo_new())) {
+		u->id = img->id;
+		u->dx = img->posx - dragged.posx;
+		u->dy = img->posy - dragged.posy;
+		u->from = dragged.scale;
+		u->to = img->scale;
+	}
+	/* the next drag of the same grab starts from here */
+	undo_begin(img);
+}
+
+static void
+undo_apply(struct undostep *u, int dir)
+{
+	struct image *img;
+	size_t i;
+
+	for (i = 0; i < u->nmoves; i++) {
+		if (!(img = image_lookup(u->moves[i].id)))
+			continue; /* removed since */
+		img->posx += dir * u->moves[i].dx;
+		img->posy += dir * u->moves[i].dy;
+		journal_image(img, JNL_MOVE);
+	}
+	if (u->moves || !(img = image_lookup(u->id)))
+		return;
+	img->posx += dir * u->dx;
+	img->posy += dir * u->dy;
+	img->scale = dir > 0 ? u->to : u->from;
+	journal_image(img, JNL_MOVE);
+}
+
+static void
+undo(void)
+{
+	arrange_finish();
+	if (undodone > 0)
+		undo_apply(undo_step(--undodone), -1);
+}
+
+static void
+redo(void)
+{
+	arrange_finish();
+	if (undodone < undocount)
+		undo_apply(undo_step(undodone++), 1);
+}
+
+/*
+ * The images are packed on shelves, the tallest first: sorted by height,
+ * each goes at the end of the current shelf or opens a new one below it
+ * when the shelf is full.  The shelves are as wide as a square of the
+ * area of the images would be, stretched to the shape of the window, and
+ * the images slide to their place in arrangetime seconds.
+ */
+#define SLIDE_FRAME (1.0 / 60)
+
+static struct {
+	int on;
+	double start;
+} slide;
+
+struct place {
+	struct image *img;
+	int w, h;
+};
+
+static int
+place_cmp(const void *a, const void *b)
+{
+	const struct place *p = a, *q = b;
+
+	if (p->h != q->h)
+		return p->h < q->h ? 1 : -1;
+	return p->img->id < q->img->id ? -1 : p->img->id > q->img->id;
+}
+
+static void
+arrange(void)
+{
+	struct undomove *moves;
+	struct undostep *u;
+	struct place *p;
+	double area = 0;
+	int x, y, w, h, rowh, maxw;
+	size_t i, n, moved = 0;
+
+	/* from where the last arrange puts them */
+	arrange_finish();
+	if (image_count == 0 || !(p = malloc(image_count * sizeof(*p))))
+		return;
+	/* the images still loading have no size yet, they stay */
+	for (n = 0, i = 0; i < image_count; i++) {
+		struct image *img = &images[i];
+
+		if (!img->width || !img->height)
+			continue;
+		p[n].img = img;
+		p[n].w = img->width * img->scale + arrangegap;
+		p[n].h = img->height * img->scale + arrangegap;
+		area += (double)p[n].w * p[n].h;
+		n++;
+	}
+	if (n == 0) {
+		free(p);
+		return;
+	}
+	qsort(p, n, sizeof(*p), place_cmp);
+
+	maxw = sqrt(area * (width ? width : 1) / (height ? height : 1));
+	for (i = 0; i < n; i++)
+		if (p[i].w > maxw)
+			maxw = p[i].w;
+	x = y = w = 0;
+	rowh = p[0].h;
+	for (i = 0; i < n; i++) {
+		if (x + p[i].w > maxw) {
+			y += rowh;
+			x = 0;
+			rowh = p[i].h;
+		}
+		p[i].img->tox = x;
+		p[i].img->toy = y;
+		x += p[i].w;
+		if (x > w)
+			w = x;
+	}
+	h = y + rowh;
+
+	/* centered on the view, undone at once */
+	moves = malloc(n * sizeof(*moves));
+	for (i = 0; i < n; i++) {
+		struct image *img = p[i].img;
+
+		img->tox += -orgx - (w - arrangegap) / 2;
+		img->toy += -orgy - (h - arrangegap) / 2;
+		img->fromx = img->posx;
+		img->fromy = img->posy;
+		img->sliding = 1;
+		if (moves && (img->tox != img->fromx || img->toy != img->fromy)) {
+			moves[moved].id = img->id;
+			moves[moved].dx = img->tox - img->fromx;
+			moves[moved++].dy = img->toy - img->fromy;
+		}
+	}
+	free(p);
+	if (moved > 0 && (u = undo_new())) {
+		u->moves = moves;
+		u->nmoves = moved;
+	} else {
+		free(moves);
+	}
+	slide.on = 1;
+	slide.start = now();
+}
+
+/* move the sliding images along, they are journaled once in place */
+static void
+arrange_step(void)
+{
+	double t, e;
+	size_t i;
+	int more = 0;
+
+	if (!slide.on)
+		return;
+	t = arrangetime > 0 ? (now() - slide.start) / arrangetime : 1;
+	if (t > 1)
+		t = 1;
+	e = t * t * (3 - 2 * t);
+	for (i = 0; i < image_count; i++) {
+		struct image *img = &images[i];
+
+		if (!img->sliding)
+			continue;
+		img->posx = img->fromx + (img->tox - img->fromx) * e;
+		img->posy = img->fromy + (img->toy - img->fromy) * e;
+		if (t < 1) {
+			more = 1;
+		} else {
+			img->sliding = 0;
+			journal_image(img, JNL_MOVE);
+		}
+	}
+	slide.on = more;
+}
+
+/* the images sliding are put in place at once */
+static void
+arrange_finish(void)
+{
+	if (!slide.on)
+		return;
+	slide.start = now() - (arrangetime > 0 ? arrangetime : 0);
+	arrange_step();
+}
+
+/*
+ * A rectangle of the screen is captured with the pointer grabbed, its
+ * pixels are read to shared memory with MIT-SHM, when the server has it,
+ * and uploaded from there as a new image.
+ */
+static struct {
+	int on;
+	int pressed;
+	int x0, y0, x1, y1; /* on the root window */
+	GC gc;
+} grab;
+
+static void
+capture(void)
+{
+	XGCValues gcv = {
+		.function = GXxor,
+		.foreground = WhitePixel(dpy, scr) ^ BlackPixel(dpy, scr),
+		.subwindow_mode = IncludeInferiors,
+	};
+
+	if (grab.on)
+		return;
+	if (XGrabPointer(dpy, root, False, ButtonPressMask | ButtonReleaseMask
+			 | PointerMotionMask, GrabModeAsync, GrabModeAsync, None,
+			 capturecursor, CurrentTime) != GrabSuccess) {
+		err("capture: Cannot grab the pointer\n");
+		return;
+	}
+	/* for escape to cancel */
+	XGrabKeyboard(dpy, root, False, GrabModeAsync, GrabModeAsync, CurrentTime);
+	if (!grab.gc)
+		grab.gc = XCreateGC(dpy, root, GCFunction | GCForeground | GCSubwindowMode, &gcv);
+	grab.on = 1;
+	grab.pressed = 0;
+}
+
+/* drawn a second time to erase it */
+static void
+capture_band(void)
+{
+	int x = grab.x0 < grab.x1 ? grab.x0 : grab.x1;
+	int y = grab.y0 < grab.y1 ? grab.y0 : grab.y1;
+
+	XDrawRectangle(dpy, root, grab.gc, x, y, abs(grab.x1 - grab.x0),
+		       abs(grab.y1 - grab.y0));
+}
+
+/* X errors are counted instead of exiting while xerror_catch is set */
+static int xerrors;
+
+static int
+xerror_catch(Display *d, XErrorEvent *e)
+{
+	(void)d;
+	(void)e;
+	xerrors++;
+	return 0;
+}
+
+static XImage *
+capture_image(int x, int y, int w, int h, XShmSegmentInfo *shm)
+{
+	Visual *v = DefaultVisual(dpy, scr);
+	int depth = DefaultDepth(dpy, scr);
+	XErrorHandler old;
+	XImage *xi = NULL;
+	int attached = 0;
+
+	/*
+	 * The extension may be there and the attach still fail, on remote
+	 * displays or in containers, its error must not exit sref.
+	 */
+	XSync(dpy, False);
+	old = XSetErrorHandler(xerror_catch);
+	xerrors = 0;
+	if (XShmQueryExtension(dpy))
+		xi = XShmCreateImage(dpy, v, depth, ZPixmap, NULL, shm, w, h);
+	if (xi) {
+		shm->shmid = shmget(IPC_PRIVATE, (size_t)xi->bytes_per_line * h, IPC_CREAT | 0600);
+		shm->shmaddr = xi->data = shm->shmid < 0 ? (void *)-1 : shmat(shm->shmid, NULL, 0);
+		shm->readOnly = False;
+		if (shm->shmaddr != (void *)-1 && XShmAttach(dpy, shm)) {
+			XSync(dpy, False);
+			attached = !xerrors;
+		}
+		if (shm->shmid >= 0)
+			shmctl(shm->shmid, IPC_RMID, NULL); /* gone once both sides detach */
+		if (attached && XShmGetImage(dpy, root, xi, x, y, AllPlanes)) {
+			XSync(dpy, False);
+			if (!xerrors) {
+				XSetErrorHandler(old);
+				return xi;
+			}
+		}
+		if (attached)
+			XShmDetach(dpy, shm);
+		if (shm->shmaddr != (void *)-1)
+			shmdt(shm->shmaddr);
+		shm->shmaddr = (void *)-1;
+		xi->data = NULL;
+		XDestroyImage(xi);
+		XSync(dpy, False);
+		xerrors = 0;
+	}
+	/* without shared memory */
+	xi = XGetImage(dpy, root, x, y, w, h, AllPlanes, ZPixmap);
+	XSync(dpy, False);
+	if (xi && xerrors) {
+		XDestroyImage(xi);
+		xi = NULL;
+	}
+	XSetErrorHandler(old);
+	return xi;
+}
+
+/* read the rectangle and show it as a new image at the view center */
+static void
+capture_done(void)
+{
+	XShmSegmentInfo shm = { .shmaddr = (void *)-1 };
+	struct job job = { 0 };
+	struct texture *t;
+	XImage *xi;
+	int x = grab.x0 < grab.x1 ? grab.x0 : grab.x1;
+	int y = grab.y0 < grab.y1 ? grab.y0 : grab.y1;
+
+	job.width = job.pw = abs(grab.x1 - grab.x0) + 1;
+	job.height = job.ph = abs(grab.y1 - grab.y0) + 1;
+	job.channels = 4;
+	if (job.width < 2 || job.height < 2)
+		return;
+	/* the band is not to be captured */
+	XSync(dpy, False);
+	if (!(xi = capture_image(x, y, job.width, job.height, &shm))) {
+		err("capture: Cannot read the screen\n");
+		return;
+	}
+	if (xi->bits_per_pixel != 32 || xi->red_mask != 0xff0000
+	    || xi->green_mask != 0xff00 || xi->blue_mask != 0xff
+	    || xi->byte_order != LSBFirst) {
+		err("capture: Unsupported visual\n");
+	} else if (image_count >= LEN(images) || !(t = texture_new("capture"))) {
+		err("capture: Cannot open image, too many open\n");
+	} else {
+		t->stream = 1;
+		image_add(t, "capture", -orgx, -orgy, 1.0);
+		if (upload_rows(t, &job, (unsigned char *)xi->data, xi->bytes_per_line, 1) < 0)
+			texture_drop(t);
+	}
+	if (shm.shmaddr != (void *)-1) {
+		XShmDetach(dpy, &shm);
+		shmdt(shm.shmaddr);
+		xi->data = NULL;
+	}
+	XDestroyImage(xi);
+}
+
+/* returns 1 if the event goes to the capture */
+static int
+capture_event(XEvent *ev)
+{
+	if (!grab.on)
+		return 0;
+	switch (ev->type) {
+	case ButtonPress:
+		if (grab.pressed)
+			break;
+		grab.pressed = 1;
+		grab.x0 = grab.x1 = ev->xbutton.x_root;
+		grab.y0 = grab.y1 = ev->xbutton.y_root;
+		capture_band();
+		break;
+	case MotionNotify:
+		if (!grab.pressed)
+			break;
+		capture_band();
+		grab.x1 = ev->xmotion.x_root;
+		grab.y1 = ev->xmotion.y_root;
+		capture_band();
+		break;
+	case ButtonRelease:
+	case KeyPress:
+		if (ev->type == KeyPress && XLookupKeysym(&ev->xkey, 0) != XK_Escape)
+			break;
+		if (grab.pressed)
+			capture_band();
+		XUngrabPointer(dpy, CurrentTime);
+		XUngrabKeyboard(dpy, CurrentTime);
+		grab.on = 0;
+		if (ev->type == ButtonRelease && grab.pressed)
+			capture_done();
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+static void *
+xgetprop(Window w, Atom prop, Atom *type, int *fmt, size_t *cnt)
+{
+	unsigned long rem;
+	void *ret = NULL;
+	int r, size = 0;
+
+	*type = None;
+	*cnt = 0;
+	do {
+		if (ret != NULL)
+			XFree(ret);
+		r = XGetWindowProperty(dpy, w, prop, 0, size, False, AnyPropertyType,
+				   type, fmt, cnt, &rem, (void *)&ret);
+		if (r != Success)
+			break;
+
+		size += rem;
+	} while (rem != 0);
+
+	return ret;
+}
+
+/* ask the clipboard owner for the image targets it has */
+static void
+paste(void)
+{
+	pasted.x = mousex;
+	pasted.y = mousey;
+	win_to_board(&pasted.x, &pasted.y);
+	pasted.target = cliptargets;
+	pasted.incr = 0;
+	pasted.len = 0;
+	XConvertSelection(dpy, clipboard, cliptargets, clipprop, win, CurrentTime);
+}
+
+/* append the property to the clipboard data, returns the bytes read */
+static size_t
+clip_read(void)
+{
+	unsigned long n, rem, size = 0;
+	unsigned char *data, *p;
+	long off = 0;
+	Atom type;
+	int fmt;
+
+	do {
+		if (XGetWindowProperty(dpy, win, clipprop, off, DND_CHUNK / 4, False,
+				       AnyPropertyType, &type, &fmt, &n, &rem,
+				       &data) != Success || !data)
+			break;
+		n = n * fmt / 8;
+		if (type != clipincr && pasted.len + n > pasted.cap) {
+			pasted.cap = pasted.cap ? pasted.cap : 65536;
+			while (pasted.len + n > pasted.cap)
+				pasted.cap *= 2;
+			if (!(p = realloc(pasted.data, pasted.cap))) {
+				XFree(data);
+				break;
+			}
+			pasted.data = p;
+		}
+		if (type == clipincr)
+			pasted.incr = 1;
+		else
+			memcpy(pasted.data + pasted.len, data, n);
+		pasted.len += type == clipincr ? 0 : n;
+		size += n;
+		off += n / 4;
+		XFree(data);
+	} while (rem > 0);
+	/* asks for the next piece of an INCR transfer */
+	XDeleteProperty(dpy, win, clipprop);
+	return size;
+}
+
+/* decode the image pasted on the workers */
+static void
+clip_done(void)
+{
+	struct texture *t;
+	struct job *job;
+
+	if (pasted.len == 0 || pasted.len > INT_MAX) {
+		err("clipboard: No image to paste\n");
+		return;
+	}
+	if (image_count >= LEN(images)) {
+		err("clipboard: Cannot open image, too many open\n");
+		return;
+	}
+	job = calloc(1, sizeof(*job));
+	if (job)
+		job->name = strdup("clipboard");
+	if (!job || !job->name || !(t = texture_new("clipboard"))) {
+		err("clipboard: %s\n", strerror(errno));
+		if (job)
+			free(job->name);
+		free(job);
+		return;
+	}
+	t->stream = 1;
+	image_add(t, "clipboard", pasted.x, pasted.y, 1.0);
+	job->kind = JOB_LOAD;
+	job->uid = t->uid;
+	job->stream = 1;
+	job->file = pasted.data;
+	job->len = pasted.len;
+	pasted.data = NULL;
+	pasted.len = pasted.cap = 0;
+	loader_push(job);
+}
+
+static void
+clip_notify(XSelectionEvent *e)
+{
+	Atom type, *targets;
+	size_t i, j, n;
+	int fmt;
+
+	if (e->property == None && pasted.target == cliptargets) {
+		/* the owner does not list its targets, try a PNG */
+		pasted.target = cliptargetatoms[0];
+		XConvertSelection(dpy, clipboard, pasted.target, clipprop, win, CurrentTime);
+		return;
+	}
+	if (e->property == None) {
+		err("clipboard: No image to paste\n");
+		return;
+	}
+	if (pasted.target == cliptargets) {
+		targets = xgetprop(win, clipprop, &type, &fmt, &n);
+		XDeleteProperty(dpy, win, clipprop);
+		pasted.target = None;
+		for (i = 0; i < LEN(cliptargetatoms) && pasted.target == None; i++)
+			for (j = 0; targets && fmt == 32 && j < n; j++)
+				if (targets[j] == cliptargetatoms[i])
+					pasted.target = cliptargetatoms[i];
+		if (targets)
+			XFree(targets);
+		if (pasted.target == None)
+			err("clipboard: No image to paste\n");
+		else
+			XConvertSelection(dpy, clipboard, pasted.target, clipprop, win, CurrentTime);
+		return;
+	}
+	clip_read();
+	if (!pasted.incr)
+		clip_done();
+}
+
+/* a piece of an INCR transfer, the last one is empty */
+static void
+xev_propnotify(XEvent *e)
+{
+	if (e->xproperty.atom != clipprop || e->xproperty.state != PropertyNewValue
+	    || !pasted.incr)
+		return;
+	if (clip_read() == 0) {
+		pasted.incr = 0;
+		clip_done();
+	}
+}
+
+static Atom
+dndmatchtarget(size_t count, Atom *target)
+{
+	size_t t, i;
+
+	for (t = 0; t < LEN(dndtargetatoms); t++)
+		for (i = 0; i < count; i++)
+			if (target[i] != None && target[i] == dndtargetatoms[t])
+				return target[i];
+
+	return None;
+}
+
+static void
+xev_visnotify(XEvent *ev)
+{
+	if (ev->xvisibility.state != VisibilityUnobscured)
+		XRaiseWindow(dpy, win);
+}
+
+/* tell the source the drop is over, it can let its data go */
+static void
+dnd_finish(int accepted)
+{
+	XClientMessageEvent m = {
+		.type = ClientMessage,
+		.display = dpy,
+		.window = dndsrc,
+		.message_type = xdndfini,
+		.format = 32,
+		.data.l = { win, accepted, accepted ? xdndacopy : None },
+	};
+
+	if (dndsrc == None)
+		return;
+	if (XSendEvent(dpy, dndsrc, False, NoEventMask, (XEvent *)&m) == 0)
+		err("xsend error\n");
+	XFlush(dpy);
+	dndsrc = None;
+}
+
+/* add the file of an URI to the files dropped */
+static void
+dnd_uri(struct job *job, char *uri, size_t *max)
+{
+	char **p;
+
+	if (strncmp(uri, "file://", strlen("file://")) != 0)
+		return;
+	/* skip the host name, if any */
+	if (!(uri = strchr(uri + strlen("file://"), '/')))
+		return;
+	urldecode(uri, uri, strlen(uri) + 1);
+	if (job->count == *max) {
+		*max = *max ? *max * 2 : 64;
+		if (!(p = realloc(job->names, *max * sizeof(*p))))
+			return;
+		job->names = p;
+	}
+	if ((job->names[job->count] = strdup(uri)))
+		job->count++;
+}
+
+/* lay the files dropped around the drop position, as they are checked */
+static void
+dnd_open(struct job *job)
+{
+	struct import *imp;
+	Window child;
+	int x, y, cols, rows;
+
+	XTranslateCoordinates(dpy, root, win, dndx, dndy, &x, &y, &child);
+	win_to_board(&x, &y);
+	if (job->count == 1)
+		load_at(job->names[0], x, y, 1.0);
+	if (job->count <= 1 || !(imp = calloc(1, sizeof(*imp)))) {
+		job_free(job);
+		return;
+	}
+	cols = job->count < gridcolumns ? job->count : gridcolumns;
+	rows = (job->count + cols - 1) / cols;
+	imp->x = x - (cols - 1) * (int)gridcell / 2;
+	imp->y = y - (rows - 1) * (int)gridcell / 2;
+	imp->scans = 1;
+	job->kind = JOB_DROP;
+	job->import = imp;
+	loader_push(job);
+}
+
+/* the URI list is read by pieces and split as it comes */
+static void
+xev_selnotify(XEvent *e)
+{
+	unsigned long n, rem, i;
+	unsigned char *data;
+	struct job *job;
+	char *line = NULL, *l;
+	size_t len = 0, cap = 0, max = 0;
+	long off = 0;
+	int fmt;
+	Atom type, prop = None;
+
+	if (e->xselection.selection == clipboard) {
+		clip_notify(&e->xselection);
+		return;
+	}
+	if (e->type == SelectionNotify)
+		prop = e->xselection.property;
+	if (prop == None) {
+		dnd_finish(0);
+		return;
+	}
+	if (!(job = calloc(1, sizeof(*job)))) {
+		err("selection allocation failed\n");
+		dnd_finish(0);
+		return;
+	}
+	do {
+		if (XGetWindowProperty(dpy, win, prop, off, DND_CHUNK / 4, False,
+				       AnyPropertyType, &type, &fmt, &n, &rem,
+				       &data) != Success || !data)
+			break;
+		n = n * fmt / 8;
+		for (i = 0; i <= n; i++) {
+			if (i < n && data[i] != '\r' && data[i] != '\n' && data[i] != '\0') {
+				if (len + 1 >= cap) {
+					cap = cap ? cap * 2 : 256;
+					if (!(l = realloc(line, cap)))
+						break;
+					line = l;
+				}
+				line[len++] = data[i];
+			} else if (len > 0 && (i < n || rem == 0)) {
+				/* the last line may go on in the next piece */
+				line[len] = '\0';
+				dnd_uri(job, line, &max);
+				len = 0;
+			}
+		}
+		off += n / 4;
+		XFree(data);
+	} while (rem > 0);
+	free(line);
+	XDeleteProperty(dpy, win, prop);
+	dnd_finish(1);
+	dnd_open(job);
+}
+
+static void
+xev_keypress(XEvent *ev)
+{
+	XKeyEvent *e = &ev->xkey;
+	unsigned int s = e->state;
+	KeySym k = XLookupKeysym(e, 1);
+	size_t i;
+
+	for (i = 0; i < LEN(shortcuts); i++) {
+		if (k == shortcuts[i].keysym && mod_match(shortcuts[i].mod, s))
+			return shortcuts[i].func();
+	}
+}
+
+static void
+xev_cmessage(XEvent *ev)
+{
+	if (ev->xclient.message_type == xdndenter) {
+		Window src = ev->xclient.data.l[0];
+		int version = ev->xclient.data.l[1] >> 24;
+		int typelist = ev->xclient.data.l[1] & 1;
+
+		if (version < dndversion)
+			err("unsupported dnd version %d\n", version);
+		if (typelist) {
+			Atom type = None;
+			int fmt;
+			Atom *data = NULL;
+			unsigned long n;
+			data = xgetprop(src, xdndtypelist, &type, &fmt, &n);
+			dndtarget = dndmatchtarget(n, data);
+			XFree(data);
+		} else {
+			dndtarget = dndmatchtarget(3, (Atom *) &ev->xclient.data.l[2]);
+		}
+	} else if (ev->xclient.message_type == xdndposition) {
+		Window src = ev->xclient.data.l[0];
+		Atom action = ev->xclient.data.l[4];
+		dndx = (ev->xclient.data.l[2] >> 16) & 0xffff;
+		dndy = ev->xclient.data.l[2] & 0xffff;
+		/* accept the drag-n-drop if we matched a target,
+		 * only xdndacopy action is supported */
+		int accept = dndtarget != None && action == xdndacopy;
+		XClientMessageEvent m = {
+			.type = ClientMessage,
+			.display = dpy,
+			.window = src,
+			.message_type = xdndstatus,
+			.format = 32,
+			.data.l = { win, accept, 0, 0, xdndacopy},
+		};
+
+		if (XSendEvent(dpy, src, False, NoEventMask, (XEvent *)&m) == 0)
+			err("xsend error\n");
+	} else if (ev->xclient.message_type == xdnddrop) {
+		Time droptimestamp = ev->xclient.data.l[2];
+		dndsrc = ev->xclient.data.l[0];
+		if (dndtarget != None)
+			XConvertSelection(dpy, xdndselection, dndtarget, xdnddata, win, droptimestamp);
+		else
+			dnd_finish(0);
+	} else if (ev->xclient.message_type == xdndleave) {
+		dndtarget = None;
+	}
+}
+
+static void
+xev_resize(XEvent *ev)
+{
+	resize(ev->xconfigure.width, ev->xconfigure.height);
+}
+
+static void
+xev_button(XEvent *ev)
+{
+	if (ev->xbutton.button == 4) /* mouse wheel up */
+		zoom += zoom * 0.1 * (ev->type == ButtonPress);
+	if (ev->xbutton.button == 5) /* mouse wheel down */
+		zoom -= zoom * 0.1 * (ev->type == ButtonPress);
+	if (ev->xbutton.button == 1)
+		lclick = ev->type == ButtonPress;
+	if (ev->xbutton.button == 2)
+		mclick = ev->type == ButtonPress;
+	if (ev->xbutton.button == 3)
+		rclick = ev->type == ButtonPress;
+}
+
+static void
+xev_motion(XEvent *ev)
+{
+	xrel -= mousex - ev->xmotion.x;
+	yrel -= mousey - ev->xmotion.y;
+
+	mousex = ev->xmotion.x;
+	mousey = ev->xmotion.y;
+}
+
+/* follow the velocity of the view while it is grabbed */
+static void
+pan(int grab)
+{
+	double t = now(), dt = t - panlast;
+
+	panlast = t;
+	if (!grab || prefetchahead <= 0 || dt <= 0 || dt > 0.5) {
+		panvx = panvy = 0;
+		return;
+	}
+	/* the view goes the opposite way of the board */
+	panvx = 0.7 * panvx - 0.3 * xrel / dt;
+	panvy = 0.7 * panvy - 0.3 * yrel / dt;
+}
+
+static void
+frame(void)
+{
+	enum action was = act;
+
+	if (lclick) {
+		if (act != MOVE)
+			XDefineCursor(dpy, win, movecursor);
+		act = MOVE;
+	} else if (rclick) {
+		if (act != SCALE)
+			XDefineCursor(dpy, win, scalecursor);
+		act = SCALE;
+	} else if (mclick) {
+		if (act != GRAB)
+			XDefineCursor(dpy, win, grabcursor);
+		act = GRAB;
+	} else {
+		if (act != NONE)
+			XDefineCursor(dpy, win, defaultcursor);
+		act = NONE;
+	}
+	/* a drag is journaled and kept for undo once over */
+	if (act != was && (was == MOVE || was == SCALE) && focus_img) {
+		journal_image(focus_img, JNL_MOVE);
+		undo_push(focus_img);
+	}
+
+	if (zoom < 0.01)
+		zoom = 0.01;
+	if (zoom > 100.0)
+		zoom = 100.0;
+
+	xrel /= zoom;
+	yrel /= zoom;
+	if (act == GRAB) {
+		orgx += xrel;
+		orgy += yrel;
+	}
+	pan(act == GRAB);
+
+	update();
+	xrel = yrel = 0;
+}
+
+/* open a PSI trigger, stalls of ms milliseconds within 2 seconds */
+static int
+psi_open(const char *kind, unsigned int ms)
+{
+	char buf[64];
+	int fd, n;
+
+	if (ms == 0)
+		return -1;
+	fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	n = snprintf(buf, sizeof(buf), "%s %u 2000000", kind, ms * 1000);
+	if (write(fd, buf, n + 1) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+pressure_init(void)
+{
+	texcap = texbytes ? texbytes : SIZE_MAX;
+	ramcap = rambytes ? rambytes : SIZE_MAX;
+	psifd[0] = psi_open("some", psisome);
+	psifd[1] = psi_open("full", psifull);
+}
+
+/* shrink the caches under memory pressure, grow them back after */
+static void
+pressure_set(int level)
+{
+	size_t i, cap;
+
+	if (level)
+		pressureend = now() + psirelax;
+	if (level && level <= pressure)
+		return;
+	pressure = level;
+
+	if (level == 0) {
+		texcap = texbytes ? texbytes : SIZE_MAX;
+		ramcap = rambytes ? rambytes : SIZE_MAX;
+		lodbias = 0;
+	} else {
+		/* a quarter less textures on some pressure, half on full */
+		cap = texused - texused / (level == 1 ? 4 : 2);
+		texcap = cap < texcap ? cap : texcap;
+		ramcap = 0;
+		lodbias = level == 2;
+		tiles_forget(0);
+		pbo_flush();
+		ram_trim();
+	}
+
+	/* pyramids in view are swapped, the others evicted */
+	for (i = 0; i < LEN(textures); i++) {
+		struct texture *t = &textures[i];
+		if (!t->refs || !t->pyramid || !t->id || t->pending || t->lodbias == lodbias)
+			continue;
+		if (t->seen == frameno)
+			texture_restore(t);
+		else
+			texture_evict(t);
+	}
+	texture_trim();
+}
+
+/* shorten the timeout of poll to wake up at the time at, 0 for never */
+static void
+timeout_at(int *timeout, double at)
+{
+	int ms;
+
+	if (!at)
+		return;
+	ms = at > now() ? (at - now()) * 1000 + 1 : 0;
+	if (*timeout < 0 || ms < *timeout)
+		*timeout = ms;
+}
+
+static void
+run(void)
+{
+	enum { PFD_X, PFD_WAKE, PFD_SOME, PFD_FULL, PFD_NOTIFY, PFD_ANIM, PFD_STREAM, PFD_CTL, PFD_COUNT };
+	/* the control socket is followed by its clients */
+	struct pollfd pfd[PFD_COUNT + CTL_CLIENTS] = {
+		[PFD_X] = { .fd = ConnectionNumber(dpy), .events = POLLIN },
+		[PFD_WAKE] = { .fd = wakefd[0], .events = POLLIN },
+		[PFD_SOME] = { .fd = psifd[0], .events = POLLPRI },
+		[PFD_FULL] = { .fd = psifd[1], .events = POLLPRI },
+		[PFD_NOTIFY] = { .fd = notifyfd, .events = POLLIN },
+		[PFD_ANIM] = { .fd = animfd, .events = POLLIN },
+		[PFD_STREAM] = { .fd = -1, .events = POLLIN },
+	};
+	XEvent ev;
+	char buf[64];
+	int dirty = 1;
+	uint64_t ticks;
+	int timeout, i;
+	double at;
+
+	for (;;) {
+		while (XPending(dpy)) {
+			XNextEvent(dpy, &ev);
+			if (XFilterEvent(&ev, None))
+				continue;
+			if (capture_event(&ev)) {
+				dirty = 1;
+				continue;
+			}
+			switch (ev.type) {
+			case KeyPress:
+				xev_keypress(&ev);
+				break;
+			case MotionNotify:
+				xev_motion(&ev);
+				break;
+			case ButtonPress:
+			case ButtonRelease:
+				xev_button(&ev);
+				break;
+			case ConfigureNotify:
+				xev_resize(&ev);
+				break;
+			case VisibilityNotify:
+				xev_visnotify(&ev);
+				break;
+			case ClientMessage:
+				if (ev.xclient.message_type == wmprotocols)
+					return; /* assume wmdeletewin */
+				xev_cmessage(&ev);
+				break;
+			case SelectionNotify:
+				xev_selnotify(&ev);
+				break;
+			case PropertyNotify:
+				xev_propnotify(&ev);
+				break;
+			default:
+				break;
+			}
+			dirty = 1;
+		}
+
+		if (dirty) {
+			frame();
+			dirty = 0;
+		}
+		/* drawing may have queued more events */
+		if (XPending(dpy))
+			continue;
+
+		/* wake up when the pressure should be over */
+		timeout = -1;
+		if (pressure)
+			timeout_at(&timeout, pressureend);
+		/* or when a changed file is due for reload */
+		timeout_at(&timeout, reload_next());
+		/* or when the journal is to be flushed */
+		timeout_at(&timeout, journal.syncat);
+		/* or for the next step of the images sliding in place */
+		if (slide.on)
+			timeout_at(&timeout, now() + SLIDE_FRAME);
+		/* or to hand the textures read back to the workers */
+		if (readbacks.head)
+			timeout_at(&timeout, now() + 0.005);
+		/* or at once for the tiles in view left to upload */
+		if (tilesleft)
+			timeout_at(&timeout, now());
+		if (animfd < 0)
+			timeout_at(&timeout, anim_next());
+		/* not read while its frames wait */
+		pfd[PFD_STREAM].fd = stream_wants() ? stream.fd : -1;
+		ctl_pollfds(pfd + PFD_CTL);
+		if (poll(pfd, LEN(pfd), timeout) < 0 && errno != EINTR)
+			die("poll: %s\n", strerror(errno));
+		for (i = PFD_SOME; i <= PFD_FULL; i++) {
+			if (pfd[i].revents & POLLPRI) {
+				pressure_set(i == PFD_SOME ? 1 : 2);
+				dirty = 1;
+			} else if (pfd[i].revents & (POLLERR | POLLNVAL)) {
+				/* the trigger is gone with its cgroup */
+				pfd[i].fd = -1;
+			}
+		}
+		if (pressure && now() >= pressureend) {
+			pressure_set(0);
+			dirty = 1;
+		}
+		if (pfd[PFD_WAKE].revents & POLLIN) {
+			while (read(wakefd[0], buf, sizeof(buf)) > 0)
+				;
+			if (loader_poll())
+				dirty = 1;
+			stream_landed();
+		}
+		if (pfd[PFD_STREAM].revents & (POLLIN | POLLHUP)) {
+			stream_read();
+			dirty = 1;
+		}
+		if (ctl_poll(pfd + PFD_CTL))
+			dirty = 1;
+		if (pfd[PFD_NOTIFY].revents & POLLIN)
+			notify_read();
+		if (journal.syncat && journal.syncat <= now())
+			journal_sync();
+		readback_poll();
+		if (pfd[PFD_ANIM].revents & POLLIN)
+			while (read(animfd, &ticks, sizeof(ticks)) > 0)
+				;
+		if (slide.on || tilesleft)
+			dirty = 1;
+		if (!dirty && (at = anim_next()) && at <= now())
+			anim_update();
+		if ((at = reload_next()) && at <= now()) {
+			reload_due();
+			dirty = 1;
+		}
+	}
+}
+
+char *
+strtrim(char *s)
+{
+	while (*s != '\0' && isspace(*s)) s++;
+	return s;
+}
+
+char *
+argsplit(char *s)
+{
+	int esc = 0;
+	char *p = s;
+
+	while (*s != '\0' && (esc || !isspace(*s))) {
+		char c = *s++;
+		if (esc == '\\') { *p++ = c; esc = 0; continue; }
+		if (c == esc)  { esc = 0; continue; }
+		if (c == '\\') { esc = c; continue; }
+		if (c == '\'') { esc = c; continue; }
+		if (c == '"')  { esc = c; continue; }
+		*p++ = c;
+	}
+	if (*s == '\0') {
+		*p = '\0';
+		return NULL; /* end of arg */
+	}
+	*p = '\0';
+	return s + 1;
+}
+
+/* put an image of the session file on the board */
+static void
+session_place(const char *file, int x, int y, float scale)
+{
+	struct image *img;
+	struct stat st;
+	size_t i;
+
+	sessionrank++;
+	/* move the image already open, or open it */
+	if (sessionsync && (img = pathtab_find(file))) {
+		img->posx = x - (int)img->width / 2;
+		img->posy = y - (int)img->height / 2;
+		img->scale = scale;
+		img->mark = 1;
+		img->key = sessionrank;
+		return;
+	}
+	if (stat(file, &st) == 0 && S_ISDIR(st.st_mode)) {
+		import_dir(file, x, y, 1);
+		return;
+	}
+	/* its key is its rank, not one of the images added */
+	i = image_count;
+	keyless = 1;
+	load_file(file, x, y, scale);
+	keyless = 0;
+	if (image_count > i) {
+		images[i].mark = 1;
+		images[i].key = sessionrank;
+	}
+}
+
+/* reads the options following the file, returns -1 if one is invalid */
+static int
+file_options(size_t argc, const char **argv, int *x, int *y, float *scale)
+{
+	const char *a;
+	size_t i;
+
+	for (i = 1; i < argc; i++) {
+		a = argv[i];
+		if (strncmp(a, "scale=", strlen("scale=")) == 0) {
+			float f = strtof(a + strlen("scale="), NULL);
+			if (f == HUGE_VALF || f == HUGE_VALL) {
+				err("%s: %s\n", a, strerror(errno));
+				return -1;
+			}
+			*scale = f;
+		}
+		else if (strncmp(a, "x=", strlen("x=")) == 0) {
+			long v = strtol(a + strlen("x="), NULL, 0);
+			if (v == LONG_MIN || v == LONG_MAX) {
+				err("%s: %s\n", a, strerror(errno));
+				return -1;
+			}
+			*x = v;
+		}
+		else if (strncmp(a, "y=", strlen("y=")) == 0) {
+			long v = strtol(a + strlen("y="), NULL, 0);
+			if (v == LONG_MIN || v == LONG_MAX) {
+				err("%s: %s\n", a, strerror(errno));
+				return -1;
+			}
+			*y = v;
+		}
+	}
+	return 0;
+}
+
+static void
+open_file(size_t argc, const char **argv)
+{
+	float scale = 1.0;
+	int x = 0, y = 0;
+
+	if (argc > 0 && file_options(argc, argv, &x, &y, &scale) == 0)
+		session_place(argv[0], x, y, scale);
+}
+
+static void
+parse_line(char *l)
+{
+	const char *argv[16];
+	size_t argc = 0;
+	char *e;
+
+	do {
+		l = strtrim(l);
+		if (*l == '\0') break;
+		e = argsplit(l);
+		argv[argc++] = l;
+		l = e;
+	} while (l != NULL && argc < LEN(argv));
+	if (argc > 0)
+		open_file(argc, argv);
+}
+
+/*
+ * Binary session file, a header followed by one record per image and
+ * the string table of the paths, each ended by a nul byte.  The file is
+ * mapped and checked in one pass, the records are then used as they
+ * are.  It is written in the byte order of the machine.
+ */
+#define SES_MAGIC "srefses1"
+
+struct ses_header {
+	char magic[8];
+	uint32_t count; /* of records */
+	uint32_t pad;
+	uint64_t strsize; /* of the string table */
+};
+
+struct ses_record {
+	int32_t x, y; /* of the center */
+	float scale;
+	uint32_t path; /* offset in the string table */
+};
+
+/* returns -1 if the file is not a binary session */
+static int
+session_map(const char *name, int fd)
+{
+	const struct ses_header *hdr;
+	const struct ses_record *rec;
+	const char *str;
+	unsigned char *map;
+	struct stat st;
+	size_t size, i;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr))
+		return -1;
+	size = st.st_size;
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	hdr = (void *)map;
+	if (memcmp(hdr->magic, SES_MAGIC, sizeof(hdr->magic)) != 0) {
+		munmap(map, size);
+		return -1;
+	}
+
+	/* validate everything once, the records can then be used blindly */
+	if ((size - sizeof(*hdr)) / sizeof(*rec) < hdr->count
+	    || hdr->strsize != size - sizeof(*hdr) - hdr->count * sizeof(*rec))
+		goto bad;
+	rec = (void *)(map + sizeof(*hdr));
+	str = (void *)(rec + hdr->count);
+	if (hdr->strsize > 0 && str[hdr->strsize - 1] != '\0')
+		goto bad;
+	for (i = 0; i < hdr->count; i++)
+		if (rec[i].path >= hdr->strsize || !isfinite(rec[i].scale))
+			goto bad;
+
+	for (i = 0; i < hdr->count; i++)
+		session_place(str + rec[i].path, rec[i].x, rec[i].y, rec[i].scale);
+	munmap(map, size);
+	binarysession = 1;
+	return 0;
+bad:
+	err("%s: Invalid session file\n", name);
+	munmap(map, size);
+	return 0;
+}
+
+static void
+read_session(const char *name)
+{
+	char *line = NULL;
+	size_t n = 0;
+	ssize_t l;
+	FILE *f;
+	int fd;
+
+	if (!name)
+		return;
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			err("%s: %s\n", name, strerror(errno));
+		else
+			die("%s: %s\n", name, strerror(errno));
+		return;
+	}
+	sessionrank = 0;
+	if (session_map(name, fd) == 0) {
+		close(fd);
+		lastkey = sessionrank;
+		return;
+	}
+	f = fdopen(fd, "r");
+	if (!f) {
+		err("%s: %s\n", name, strerror(errno));
+		close(fd);
+		return;
+	}
+	binarysession = 0;
+
+	while ((l = getline(&line, &n, f)) != -1) {
+		char *p;
+		p = strchr(line, '#');
+		if (p) *p = '\0';
+		p = strchr(line, '\n');
+		if (p) *p = '\0';
+		parse_line(line);
+	}
+	free(line);
+	fclose(f);
+	lastkey = sessionrank;
+}
+
+static void
+session_write_text(FILE *f)
+{
+	size_t i;
+
+	fprintf(f, "#!%s -f\n", argv0);
+	for (i = 0; i < image_count; i++) {
+		const char *p = images[i].path;
+		int x = images[i].posx + images[i].width / 2;
+		int y = images[i].posy + images[i].height / 2;
+		float s = images[i].scale;
+		if (images[i].tex->stream)
+			continue; /* gone with the stream */
+		fprintf(f, "'%s' x=%d y=%d scale=%f\n", p, x, y, s);
+	}
+	for (i = 0; i < nlost; i++)
+		fprintf(f, "'%s' x=%d y=%d scale=%f\n", lost[i].path,
+			lost[i].x, lost[i].y, lost[i].scale);
+}
+
+static void
+session_write_bin(FILE *f)
+{
+	struct ses_header hdr = { 0 };
+	struct ses_record rec;
+	size_t i;
+
+	memcpy(hdr.magic, SES_MAGIC, sizeof(hdr.magic));
+	for (i = 0; i < image_count; i++) {
+		if (images[i].tex->stream)
+			continue; /* gone with the stream */
+		hdr.count++;
+		hdr.strsize += strlen(images[i].path) + 1;
+	}
+	for (i = 0; i < nlost; i++) {
+		hdr.count++;
+		hdr.strsize += strlen(lost[i].path) + 1;
+	}
+	if (hdr.strsize > UINT32_MAX) {
+		err("session: Too many images\n");
+		return;
+	}
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	rec.path = 0;
+	for (i = 0; i < image_count; i++) {
+		if (images[i].tex->stream)
+			continue;
+		rec.x = images[i].posx + images[i].width / 2;
+		rec.y = images[i].posy + images[i].height / 2;
+		rec.scale = images[i].scale;
+		fwrite(&rec, sizeof(rec), 1, f);
+		rec.path += strlen(images[i].path) + 1;
+	}
+	for (i = 0; i < nlost; i++) {
+		rec.x = lost[i].x;
+		rec.y = lost[i].y;
+		rec.scale = lost[i].scale;
+		fwrite(&rec, sizeof(rec), 1, f);
+		rec.path += strlen(lost[i].path) + 1;
+	}
+	for (i = 0; i < image_count; i++)
+		if (!images[i].tex->stream)
+			fwrite(images[i].path, strlen(images[i].path) + 1, 1, f);
+	for (i = 0; i < nlost; i++)
+		fwrite(lost[i].path, strlen(lost[i].path) + 1, 1, f);
+}
+
+/*
+ * Sessions are saved in the background, the board is written in memory
+ * and a worker writes it under a temporary name and syncs it, the main
+ * thread renames it in place once done.  Returns the serial of the save,
+ * 0 if it could not start.
+ */
+static unsigned long
+write_session(const char *name)
+{
+	static unsigned long serial;
+	struct job *job = NULL;
+	uint32_t *keys = NULL;
+	char *buf = NULL;
+	size_t len = 0, i, n = 0;
+	int own;
+	FILE *f;
+
+	if (!name)
+		return 0;
+	own = session_file && strcmp(name, session_file) == 0;
+	if (!(f = open_memstream(&buf, &len)))
+		goto fail;
+	if (binarysession)
+		session_write_bin(f);
+	else
+		session_write_text(f);
+	if (fclose(f) != 0 || !(job = calloc(1, sizeof(*job)))
+	    || !(job->name = strdup(name))
+	    || (own && !(keys = calloc(image_count + nlost + 1, sizeof(*keys)))))
+		goto fail;
+	job->kind = JOB_SESSION;
+	job->uid = ++serial; /* not a texture, the save */
+	job->file = (unsigned char *)buf;
+	job->len = len;
+	if (own) {
+		/* the keys become the ranks in the file written */
+		for (i = 0; i < image_count; i++) {
+			if (images[i].tex->stream)
+				continue;
+			/* found under a directory line, in the file from now on */
+			if (!images[i].key)
+				images[i].key = ++lastkey;
+			keys[n++] = images[i].key;
+		}
+		/* the lost images take the ranks after, with no key */
+		n += nlost;
+		free(journal.keys);
+		journal.keys = keys;
+		journal.nkeys = n;
+		journal.snaplast = lastkey;
+		journal.tailsize = 0;
+		journal.compacting = journal.last = job->uid;
+	}
+	savesbusy++;
+	loader_push_front(job); /* ahead of the images */
+	return job->uid;
+fail:
+	err("%s: %s\n", name, strerror(errno));
+	if (job)
+		free(job->name);
+	free(job);
+	free(buf);
+	free(keys);
+	return 0;
+}
+
+static struct image *
+image_by_key(unsigned long key)
+{
+	size_t lo = 0, hi = image_count, mid, i;
+
+	if (!key)
+		return NULL;
+	/* the keys grow with the images, unless the session was reloaded */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (images[mid].key == key)
+			return &images[mid];
+		if (images[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (i = 0; i < image_count; i++)
+		if (images[i].key == key)
+			return &images[i];
+	return NULL;
+}
+
+static void
+journal_ident(struct jnl_header *hdr, const struct stat *st)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, JNL_MAGIC, sizeof(hdr->magic));
+	hdr->ino = st->st_ino;
+	hdr->size = st->st_size;
+	hdr->mtime = stat_mtime(st);
+}
+
+static void
+journal_replay(const struct jnl_record *rec, const char *p, unsigned long *last)
+{
+	char path[PATH_MAX];
+	struct image *img;
+	size_t n;
+
+	switch (rec->kind) {
+	case JNL_ADD:
+		memcpy(path, p, rec->len);
+		path[rec->len] = '\0';
+		n = image_count;
+		load_at(path, rec->x, rec->y, rec->scale);
+		if (image_count > n)
+			images[n].key = rec->key;
+		if (rec->key > *last)
+			*last = rec->key;
+		break;
+	case JNL_MOVE:
+		if (!(img = image_by_key(rec->key)))
+			break;
+		img->posx = rec->x - (int)img->width / 2;
+		img->posy = rec->y - (int)img->height / 2;
+		img->scale = rec->scale;
+		break;
+	case JNL_REMOVE:
+		if ((img = image_by_key(rec->key)))
+			image_remove(img);
+		break;
+	}
+}
+
+/* replay the journal over the session file read, and keep it open */
+static void
+journal_open(void)
+{
+	struct jnl_header hdr;
+	struct jnl_record rec;
+	unsigned char *map = MAP_FAILED;
+	unsigned long last = lastkey;
+	size_t size = 0, off = 0;
+	struct stat st;
+	int fd;
+
+	if (!session_file || journalbytes == 0)
+		return;
+	if (!(journal.path = malloc(strlen(session_file) + sizeof(".journal"))))
+		return;
+	sprintf(journal.path, "%s.journal", session_file);
+	fd = open(journal.path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		err("%s: %s\n", journal.path, strerror(errno));
+		return;
+	}
+	journal_ident(&hdr, &sessionst);
+	if (fstat(fd, &st) == 0 && (size = st.st_size) >= sizeof(hdr))
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map != MAP_FAILED && memcmp(map, &hdr, sizeof(hdr)) == 0) {
+		for (off = sizeof(hdr); size - off >= sizeof(rec); off += sizeof(rec) + rec.len) {
+			memcpy(&rec, map + off, sizeof(rec));
+			if (rec.kind < JNL_ADD || rec.kind > JNL_REMOVE
+			    || rec.len >= PATH_MAX || (rec.len && rec.kind != JNL_ADD)
+			    || size - off - sizeof(rec) < rec.len)
+				break; /* torn by a crash */
+			journal_replay(&rec, (char *)map + off + sizeof(rec), &last);
+		}
+	} else if (size > 0) {
+		err("%s: Not the journal of %s, ignored\n", journal.path, session_file);
+	}
+	if (map != MAP_FAILED)
+		munmap(map, size);
+	lastkey = last;
+
+	/* the records of a crash, if any, are cut */
+	if (off == 0 && (ftruncate(fd, 0) < 0
+	    || write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))) {
+		err("%s: %s\n", journal.path, strerror(errno));
+		close(fd);
+		return;
+	}
+	if (off > 0 && off < size)
+		ftruncate(fd, off);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_APPEND);
+	journal.fd = fd;
+	journal.size = off ? off : sizeof(hdr);
+	journal.compactat = journalbytes;
+}
+
+/* the journal starts over after the session file */
+static void
+journal_reset(void)
+{
+	struct jnl_header hdr;
+
+	free(journal.keys);
+	journal.keys = NULL;
+	journal.compacting = 0;
+	if (journal.fd < 0)
+		return;
+	journal_ident(&hdr, &sessionst);
+	if (ftruncate(journal.fd, 0) < 0
+	    || write(journal.fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		err("%s: %s\n", journal.path, strerror(errno));
+		close(journal.fd);
+		journal.fd = -1;
+		return;
+	}
+	journal.size = sizeof(hdr);
+	journal.compactat = journalbytes;
+}
+
+static void
+journal_append(const void *buf, size_t len)
+{
+	size_t cap = journal.tailcap ? journal.tailcap : 4096;
+	char *p;
+
+	if (write(journal.fd, buf, len) != (ssize_t)len) {
+		err("%s: %s\n", journal.path, strerror(errno));
+		close(journal.fd);
+		journal.fd = -1;
+		return;
+	}
+	journal.size += len;
+	if (!journal.syncat)
+		journal.syncat = now() + journalsync;
+	if (journal.compacting) {
+		/* kept to start the next journal with */
+		while (cap < journal.tailsize + len)
+			cap *= 2;
+		if (cap > journal.tailcap) {
+			if (!(p = realloc(journal.tail, cap))) {
+				journal.compacting = 0;
+				return;
+			}
+			journal.tail = p;
+			journal.tailcap = cap;
+		}
+		memcpy(journal.tail + journal.tailsize, buf, len);
+		journal.tailsize += len;
+	} else if (journal.size > journal.compactat && !write_session(session_file)) {
+		journal.compactat = journal.size + journalbytes;
+	}
+}
+
+static void
+journal_image(struct image *img, int kind)
+{
+	struct jnl_record rec = { 0 };
+	char buf[sizeof(rec) + PATH_MAX];
+	size_t len = 0;
+
+	if (journal.fd < 0 || sessionsync || !img->key)
+		return;
+	if (kind == JNL_ADD && (len = strlen(img->path)) >= PATH_MAX)
+		return;
+	rec.kind = kind;
+	rec.len = len;
+	rec.key = img->key;
+	rec.x = img->posx + (int)img->width / 2;
+	rec.y = img->posy + (int)img->height / 2;
+	rec.scale = img->scale;
+	memcpy(buf, &rec, sizeof(rec));
+	memcpy(buf + sizeof(rec), img->path, len);
+	journal_append(buf, sizeof(rec) + len);
+}
+
+/* the records written reach the disk in the background */
+static void
+journal_sync(void)
+{
+	struct job *job;
+
+	journal.syncat = 0;
+	if (journal.fd < 0 || !(job = calloc(1, sizeof(*job))))
+		return;
+	job->kind = JOB_SYNC;
+	job->fd = fcntl(journal.fd, F_DUPFD_CLOEXEC, 0);
+	if (job->fd < 0) {
+		free(job);
+		return;
+	}
+	loader_push_front(job);
+}
+
+/* write the session file under a temporary name */
+static void
+job_session(struct job *job)
+{
+	size_t off = 0;
+	ssize_t n;
+	int fd;
+
+	job->kind = JOB_SAVED;
+	/* a link is kept, the file it points to is replaced */
+	if (!(job->target = realpath(job->name, NULL)) && errno != ENOENT) {
+		job->error = errno;
+		return;
+	}
+	if (!job->target && !(job->target = strdup(job->name))) {
+		job->error = errno;
+		return;
+	}
+	snprintf(job->path, sizeof(job->path), "%s.%ld.%lu", job->target, (long)getpid(), job->uid);
+	fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		job->error = errno;
+		return;
+	}
+	/* and keeps its mode */
+	if (stat(job->target, &job->st) == 0 && fchmod(fd, job->st.st_mode & 07777) < 0) {
+		job->error = errno;
+		close(fd);
+		unlink(job->path);
+		return;
+	}
+	while (off < job->len) {
+		n = write(fd, job->file + off, job->len - off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;
+		off += n;
+	}
+	if (off < job->len || fsync(fd) < 0 || fstat(fd, &job->st) < 0)
+		job->error = errno;
+	if (close(fd) < 0 && !job->error)
+		job->error = errno;
+	if (job->error)
+		unlink(job->path);
+}
+
+/* the new key of an image once the snapshot is the session file */
+static uint32_t
+journal_remap(const uint32_t *rank, unsigned long key)
+{
+	if (key > journal.snaplast)
+		return key - journal.snaplast + journal.nkeys;
+	return rank[key];
+}
+
+/*
+ * The save of the session file is written, it takes its place and the
+ * records written since start the new journal.  A crash between the two
+ * renames loses these records, the old journal is not replayed over the
+ * new session file.
+ */
+static void
+journal_saved(struct job *job)
+{
+	struct jnl_header hdr;
+	struct jnl_record rec;
+	char tmp[PATH_MAX + 32];
+	uint32_t *rank;
+	size_t i;
+	int fd = -1;
+
+	journal.compacting = 0;
+	journal.compactat = journal.size + journalbytes;
+	if (job->error)
+		return;
+	if (!(rank = calloc(journal.snaplast + 1, sizeof(*rank)))) {
+		job->error = errno;
+		unlink(job->path);
+		return;
+	}
+	for (i = 0; i < journal.nkeys; i++)
+		if (journal.keys[i])
+			rank[journal.keys[i]] = i + 1;
+	for (i = 0; i < journal.tailsize; i += sizeof(rec) + rec.len) {
+		memcpy(&rec, journal.tail + i, sizeof(rec));
+		rec.key = journal_remap(rank, rec.key);
+		memcpy(journal.tail + i, &rec, sizeof(rec));
+	}
+
+	if (journal.fd >= 0) {
+		journal_ident(&hdr, &job->st);
+		snprintf(tmp, sizeof(tmp), "%s.%ld", journal.path, (long)getpid());
+		fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+		if (fd < 0 || write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+		    || write(fd, journal.tail, journal.tailsize) != (ssize_t)journal.tailsize)
+			job->error = errno;
+	}
+	if (!job->error && rename(job->path, job->target) < 0)
+		job->error = errno;
+	if (job->error) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		unlink(job->path);
+		free(rank);
+		return;
+	}
+	/* not to be read again when its change is notified */
+	sessionst = job->st;
+	if (fd >= 0) {
+		close(journal.fd);
+		journal.fd = fd;
+		if (rename(tmp, journal.path) < 0) {
+			err("%s: %s\n", journal.path, strerror(errno));
+			close(journal.fd);
+			journal.fd = -1;
+		}
+		journal.size = sizeof(hdr) + journal.tailsize;
+		journal.compactat = journalbytes;
+		if (!journal.syncat)
+			journal.syncat = now() + journalsync;
+	}
+
+	for (i = 0; i < image_count; i++)
+		if (images[i].key)
+			images[i].key = journal_remap(rank, images[i].key);
+	lastkey = lastkey > journal.snaplast ? journal_remap(rank, lastkey) : journal.nkeys;
+	free(rank);
+	free(journal.keys);
+	journal.keys = NULL;
+}
+
+/*
+ * The serial of the last save put in place for each file, an older save
+ * written after it is not put over it.  Forgotten once no save is left
+ * being written.
+ */
+static struct placed {
+	char *target;
+	unsigned long uid;
+} *placed;
+static size_t placedcount;
+
+static struct placed *
+placed_find(const char *target)
+{
+	size_t i;
+
+	for (i = 0; i < placedcount; i++)
+		if (strcmp(placed[i].target, target) == 0)
+			return &placed[i];
+	return NULL;
+}
+
+static void
+placed_mark(const char *target, unsigned long uid)
+{
+	struct placed *p;
 
-		if (XSendEvent(dpy, src, False, NoEventMask, (XEvent *)&m) == 0)
-			err("xsend error\n");
-	} else if (ev->xclient.message_type == xdnddrop) {
-		Time droptimestamp = ev->xclient.data.l[2];
-		if (dndtarget != None)
-			XConvertSelection(dpy, xdndselection, dndtarget, xdnddata, win, droptimestamp);
-	} else if (ev->xclient.message_type == xdndleave) {
-		dndtarget = None;
+	if ((p = placed_find(target))) {
+		if (p->uid < uid)
+			p->uid = uid;
+		return;
 	}
+	if (!(p = realloc(placed, (placedcount + 1) * sizeof(*p))))
+		return;
+	placed = p;
+	if ((placed[placedcount].target = strdup(target)))
+		placed[placedcount++].uid = uid;
 }
 
+/* a save is written, it is put in place and reported */
 static void
-xev_resize(XEvent *ev)
+session_saved(struct job *job)
 {
-	resize(ev->xconfigure.width, ev->xconfigure.height);
+	int own = session_file && strcmp(job->name, session_file) == 0;
+	struct placed *p;
+
+	savesbusy--;
+	if (own && job->uid != journal.compacting) {
+		/* saved again since, or read again from the file */
+		if (!job->error)
+			unlink(job->path);
+		job->error = job->uid < journal.last ? 0 : ECANCELED;
+	} else if (own) {
+		journal_saved(job);
+	} else if (!job->error && (p = placed_find(job->target)) && p->uid > job->uid) {
+		/* a newer save of the file is already in place */
+		unlink(job->path);
+	} else if (!job->error && rename(job->path, job->target) < 0) {
+		job->error = errno;
+		unlink(job->path);
+	}
+	if (!job->error && job->target)
+		placed_mark(job->target, job->uid);
+	if (savesbusy == 0) {
+		while (placedcount > 0)
+			free(placed[--placedcount].target);
+		free(placed);
+		placed = NULL;
+	}
+	if (job->error)
+		err("%s: %s\n", job->name, strerror(job->error));
+	ctl_saved(job->uid, job->name, job->error);
 }
 
+/* wait for the saves being written */
 static void
-xev_button(XEvent *ev)
+session_flush(void)
 {
-	if (ev->xbutton.button == 4) /* mouse wheel up */
-		zoom += zoom * 0.1 * (ev->type == ButtonPress);
-	if (ev->xbutton.button == 5) /* mouse wheel down */
-		zoom -= zoom * 0.1 * (ev->type == ButtonPress);
-	if (ev->xbutton.button == 1)
-		lclick = ev->type == ButtonPress;
-	if (ev->xbutton.button == 2)
-		mclick = ev->type == ButtonPress;
-	if (ev->xbutton.button == 3)
-		rclick = ev->type == ButtonPress;
+	struct pollfd pfd = { .fd = wakefd[0], .events = POLLIN };
+	char buf[64];
+
+	while (savesbusy > 0) {
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+		while (read(wakefd[0], buf, sizeof(buf)) > 0)
+			;
+		loader_poll();
+	}
 }
 
-static void
-xev_motion(XEvent *ev)
+/*
+ * Control socket, clients send commands one per line, split like the
+ * lines of the session file, and get a line back for each:
+ *
+ *	add <file> [x=<x>] [y=<y>] [scale=<s>]	ok <id>
+ *	move <id> <x> <y>			ok
+ *	scale <id> <s>				ok
+ *	remove <id>				ok
+ *	save [<file>]				ok
+ *	query					<id> <x> <y> <scale> <w> <h> '<file>'
+ *						... then ok <count>
+ *	pixels <id>|new <w> <h> <format> <stride> [x=<x>] [y=<y>] [scale=<s>] [name=<n>]
+ *						ok <id>
+ *
+ * The pixels come from a file descriptor, a memfd, sent along with the
+ * command as SCM_RIGHTS, the descriptors are taken in the order they come
+ * by the commands which need one.  Errors are answered with
+ * "error: <reason>".  Positions are the center
+ * of the images, as in the session file.  All the commands read at once
+ * are applied together before the board is drawn again, and a client is
+ * not read while its replies are not sent, or while its save is written.
+ */
+#define CTL_LINE 4096 /* longest command */
+#define CTL_READ (1024 * 1024) /* commands read at once */
+#define CTL_FDS 16 /* descriptors received not yet used */
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
+#if defined(__linux__) && !defined(F_GET_SEALS)
+#define F_GET_SEALS 1034
+#define F_SEAL_SHRINK 0x0002
+#endif
+
+static int ctlfd = -1;
+static struct client {
+	int fd;
+	int eof;
+	char *in, *out;
+	size_t inlen, outlen, outcap;
+	int fds[CTL_FDS];
+	size_t nfds;
+	unsigned long saving; /* save answered once written */
+} clients[CTL_CLIENTS];
+
+/* returns 1 if a sref answers on the socket */
+static int
+ctl_alive(const struct sockaddr_un *sa)
 {
-	xrel -= mousex - ev->xmotion.x;
-	yrel -= mousey - ev->xmotion.y;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	int alive = fd >= 0 && connect(fd, (const struct sockaddr *)sa, sizeof(*sa)) == 0;
 
-	mousex = ev->xmotion.x;
-	mousey = ev->xmotion.y;
+	if (fd >= 0)
+		close(fd);
+	errno = EADDRINUSE;
+	return alive;
 }
 
 static void
-run(void)
+ctl_init(const char *path)
 {
-	XEvent ev;
-
-	update();
-	xrel = yrel = 0;
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	size_t i;
+	int r;
+
+	for (i = 0; i < LEN(clients); i++)
+		clients[i].fd = -1;
+	if (strlen(path) >= sizeof(sa.sun_path))
+		die("%s: %s\n", path, strerror(ENAMETOOLONG));
+	strcpy(sa.sun_path, path);
+	ctlfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (ctlfd < 0)
+		die("socket: %s\n", strerror(errno));
+	r = bind(ctlfd, (struct sockaddr *)&sa, sizeof(sa));
+	if (r < 0 && errno == EADDRINUSE && !ctl_alive(&sa)) {
+		/* left over by a sref gone */
+		unlink(path);
+		r = bind(ctlfd, (struct sockaddr *)&sa, sizeof(sa));
+	}
+	if (r < 0 || listen(ctlfd, LEN(clients)) < 0)
+		die("%s: %s\n", path, strerror(errno));
+	fcntl(ctlfd, F_SETFL, fcntl(ctlfd, F_GETFL) | O_NONBLOCK);
+	fcntl(ctlfd, F_SETFD, FD_CLOEXEC);
+}
 
-	while (!XNextEvent(dpy, &ev)) {
-		if (!XFilterEvent(&ev, None))
-		switch (ev.type) {
-		case KeyPress:
-			xev_keypress(&ev);
-			break;
-		case MotionNotify:
-			xev_motion(&ev);
-			break;
-		case ButtonPress:
-		case ButtonRelease:
-			xev_button(&ev);
-			break;
-		case ConfigureNotify:
-			xev_resize(&ev);
-			break;
-		case VisibilityNotify:
-			xev_visnotify(&ev);
-			break;
-		case ClientMessage:
-			if (ev.xclient.message_type == wmprotocols)
-				return; /* assume wmdeletewin */
-			xev_cmessage(&ev);
-			break;
-		case SelectionNotify:
-			xev_selnotify(&ev);
-			break;
-		default:
-			break;
-		}
+static void
+ctl_close(struct client *c)
+{
+	while (c->nfds > 0)
+		close(c->fds[--c->nfds]);
+	close(c->fd);
+	free(c->in);
+	free(c->out);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
 
-		if (XPending(dpy) == 0) {
-			if (lclick) {
-				if (act != MOVE)
-					XDefineCursor(dpy, win, movecursor);
-				act = MOVE;
-			} else if (rclick) {
-				if (act != SCALE)
-					XDefineCursor(dpy, win, scalecursor);
-				act = SCALE;
-			} else if (mclick) {
-				if (act != GRAB)
-					XDefineCursor(dpy, win, grabcursor);
-				act = GRAB;
-			} else {
-				if (act != NONE)
-					XDefineCursor(dpy, win, defaultcursor);
-				act = NONE;
-			}
+static void
+ctl_accept(void)
+{
+	struct client *c;
+	size_t i;
+	int fd;
 
-			if (zoom < 0.01)
-				zoom = 0.01;
-			if (zoom > 100.0)
-				zoom = 100.0;
+	while ((fd = accept(ctlfd, NULL, NULL)) >= 0) {
+		for (i = 0; i < LEN(clients) && clients[i].fd >= 0; i++)
+			;
+		c = i < LEN(clients) ? &clients[i] : NULL;
+		if (!c || !(c->in = malloc(CTL_READ))) {
+			err("control: Too many clients\n");
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		c->fd = fd;
+	}
+}
 
-			xrel /= zoom;
-			yrel /= zoom;
-			if (act == GRAB) {
-				orgx += xrel;
-				orgy += yrel;
-			}
+static void
+ctl_reply(struct client *c, const char *fmt, ...)
+{
+	va_list ap;
+	size_t cap;
+	char *out;
+	int n;
 
-			update();
-			xrel = yrel = 0;
-		}
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if (c->outlen + n + 2 > c->outcap) {
+		cap = c->outcap ? c->outcap : 4096;
+		while (c->outlen + n + 2 > cap)
+			cap *= 2;
+		if (!(out = realloc(c->out, cap)))
+			return;
+		c->out = out;
+		c->outcap = cap;
 	}
+	va_start(ap, fmt);
+	vsnprintf(c->out + c->outlen, n + 1, fmt, ap);
+	va_end(ap);
+	c->outlen += n;
+	c->out[c->outlen++] = '\n';
 }
 
-char *
-strtrim(char *s)
+static struct image *
+image_by_id(const char *s)
 {
-	while (*s != '\0' && isspace(*s)) s++;
-	return s;
+	return image_lookup(strtoul(s, NULL, 0));
 }
 
-char *
-argsplit(char *s)
+/* the texture of the image, for its pixels to be replaced */
+static struct texture *
+image_own(struct image *img)
 {
-	int esc = 0;
-	char *p = s;
+	struct texture *t = img->tex;
+
+	if (t->stream && t->refs == 1) {
+		ramused -= t->qoisize;
+		free(t->qoi);
+		t->qoi = NULL;
+		t->qoisize = 0;
+		return t;
+	}
+	if (!(t = texture_new(img->path)))
+		return NULL;
+	t->stream = 1;
+	/* not in the session anymore */
+	journal_image(img, JNL_REMOVE);
+	img->key = 0;
+	texture_unref(img->tex);
+	img->tex = t;
+	return t;
+}
 
-	while (*s != '\0' && (esc || !isspace(*s))) {
-		char c = *s++;
-		if (esc == '\\') { *p++ = c; esc = 0; continue; }
-		if (c == esc)  { esc = 0; continue; }
-		if (c == '\\') { esc = c; continue; }
-		if (c == '\'') { esc = c; continue; }
-		if (c == '"')  { esc = c; continue; }
-		*p++ = c;
+/*
+ * Map the pixels of fd, when it is sealed against shrinking, or read them
+ * in memory, the sender could truncate a mapping under our feet.
+ */
+static unsigned char *
+pixels_map(int fd, size_t size, int *copied)
+{
+	unsigned char *map;
+	size_t off;
+	ssize_t r;
+
+	*copied = 0;
+#ifdef F_GET_SEALS
+	{
+		int seals = fcntl(fd, F_GET_SEALS);
+
+		if (seals >= 0 && (seals & F_SEAL_SHRINK)) {
+			map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+			return map == MAP_FAILED ? NULL : map;
+		}
 	}
-	if (*s == '\0') {
-		*p = '\0';
-		return NULL; /* end of arg */
+#endif
+	if (!(map = malloc(size)))
+		return NULL;
+	for (off = 0; off < size; off += r) {
+		r = pread(fd, map + off, size - off, off);
+		if (r < 0 && errno == EINTR) {
+			r = 0;
+			continue;
+		}
+		if (r <= 0) {
+			if (r == 0)
+				errno = EIO;
+			free(map);
+			return NULL;
+		}
 	}
-	*p = '\0';
-	return s + 1;
+	*copied = 1;
+	return map;
 }
 
+/* upload the pixels of a memfd */
 static void
-open_file(size_t argc, const char **argv)
+ctl_pixels(struct client *c, size_t argc, const char **argv)
 {
-	const char *file;
-	const char *a;
+	static const char *formats[] = { "grey", "greya", "rgb", "rgba" };
+	const char *name = "pixels";
+	struct texture *t = NULL;
+	struct image *img = NULL;
+	struct job job = { 0 };
+	size_t i, n, stride, size;
+	int x = 0, y = 0, fd, copied;
 	float scale = 1.0;
-	int x = 0, y = 0;
-	size_t i;
+	unsigned char *map;
+	struct stat st;
 
-	if (argc < 1)
+	if (argc < 6) {
+		ctl_reply(c, "error: pixels: missing arguments");
 		return;
-	file = argv[0];
-	for (i = 1; i < argc; i++) {
-		a = argv[i];
-		if (strncmp(a, "scale=", strlen("scale=")) == 0) {
-			float f = strtof(a + strlen("scale="), NULL);
-			if (f == HUGE_VALF || f == HUGE_VALL) {
-				err("%s: %s\n", a, strerror(errno));
-				return;
-			}
-			scale = f;
+	}
+	if (c->nfds == 0) {
+		ctl_reply(c, "error: pixels: no file descriptor");
+		return;
+	}
+	fd = c->fds[0];
+	memmove(c->fds, c->fds + 1, --c->nfds * sizeof(*c->fds));
+
+	job.width = job.pw = strtol(argv[2], NULL, 0);
+	job.height = job.ph = strtol(argv[3], NULL, 0);
+	for (i = 0; i < LEN(formats) && strcmp(argv[4], formats[i]) != 0; i++)
+		;
+	job.channels = i + 1;
+	stride = strtoul(argv[5], NULL, 0);
+	for (i = 6; i < argc; i++) {
+		if (strncmp(argv[i], "x=", 2) == 0)
+			x = strtol(argv[i] + 2, NULL, 0);
+		else if (strncmp(argv[i], "y=", 2) == 0)
+			y = strtol(argv[i] + 2, NULL, 0);
+		else if (strncmp(argv[i], "scale=", 6) == 0)
+			scale = strtof(argv[i] + 6, NULL);
+		else if (strncmp(argv[i], "name=", 5) == 0)
+			name = argv[i] + 5;
+	}
+	n = (size_t)job.width * job.channels;
+	if (job.channels > 4 || job.width <= 0 || job.height <= 0
+	    || job.width > maxtexsize || job.height > maxtexsize || stride < n
+	    || stride > (size_t)maxtexsize * 16
+	    || (job.height > 1 && stride > (SIZE_MAX - n) / (job.height - 1))) {
+		ctl_reply(c, "error: pixels: bad size or format");
+		close(fd);
+		return;
+	}
+	size = stride * (job.height - 1) + n;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < size) {
+		ctl_reply(c, "error: pixels: file too small");
+		close(fd);
+		return;
+	}
+	map = pixels_map(fd, size, &copied);
+	close(fd);
+	if (!map) {
+		ctl_reply(c, "error: pixels: %s", strerror(errno));
+		return;
+	}
+
+	if (strcmp(argv[1], "new") != 0) {
+		if (!(img = image_by_id(argv[1])))
+			ctl_reply(c, "error: %s: no such image", argv[1]);
+		else if (!(t = image_own(img)))
+			ctl_reply(c, "error: %s: too many images", argv[1]);
+	} else if (image_count >= LEN(images) || !(t = texture_new(name))) {
+		ctl_reply(c, "error: %s: too many images", name);
+	} else {
+		t->stream = 1;
+		img = image_add(t, name, x, y, scale);
+	}
+	if (t && upload_rows(t, &job, map, stride, 0) == 0)
+		ctl_reply(c, "ok %lu", img->id);
+	else if (t)
+		ctl_reply(c, "error: pixels: pixel buffer lost");
+	if (copied)
+		free(map);
+	else
+		munmap(map, size);
+}
+
+static void
+ctl_command(struct client *c, size_t argc, const char **argv)
+{
+	struct image *img = NULL;
+	struct stat st;
+	float scale;
+	size_t i, n;
+	int x, y;
+
+	if (strcmp(argv[0], "move") == 0 || strcmp(argv[0], "scale") == 0
+	    || strcmp(argv[0], "remove") == 0) {
+		if (argc < 2 || !(img = image_by_id(argv[1]))) {
+			ctl_reply(c, "error: %s: no such image", argc < 2 ? "" : argv[1]);
+			return;
 		}
-		else if (strncmp(a, "x=", strlen("x=")) == 0) {
-			long v = strtol(a + strlen("x="), NULL, 0);
-			if (v == LONG_MIN || v == LONG_MAX) {
-				err("%s: %s\n", a, strerror(errno));
-				return;
-			}
-			x = v;
+	}
+	if (strcmp(argv[0], "add") == 0 && argc > 1) {
+		if (stat(argv[1], &st) < 0) {
+			ctl_reply(c, "error: %s: %s", argv[1], strerror(errno));
+			return;
 		}
-		else if (strncmp(a, "y=", strlen("y=")) == 0) {
-			long v = strtol(a + strlen("y="), NULL, 0);
-			if (v == LONG_MIN || v == LONG_MAX) {
-				err("%s: %s\n", a, strerror(errno));
-				return;
-			}
-			y = v;
+		n = image_count;
+		x = 0, y = 0, scale = 1.0;
+		if (file_options(argc - 1, argv + 1, &x, &y, &scale) == 0)
+			load_at(argv[1], x, y, scale);
+		if (image_count > n)
+			ctl_reply(c, "ok %lu", images[n].id);
+		else if (S_ISDIR(st.st_mode))
+			ctl_reply(c, "ok");
+		else
+			ctl_reply(c, "error: %s: cannot open", argv[1]);
+	} else if (strcmp(argv[0], "move") == 0 && argc == 4) {
+		img->posx = strtol(argv[2], NULL, 0) - (int)img->width / 2;
+		img->posy = strtol(argv[3], NULL, 0) - (int)img->height / 2;
+		journal_image(img, JNL_MOVE);
+		ctl_reply(c, "ok");
+	} else if (strcmp(argv[0], "scale") == 0 && argc == 3) {
+		img->scale = strtof(argv[2], NULL);
+		journal_image(img, JNL_MOVE);
+		ctl_reply(c, "ok");
+	} else if (strcmp(argv[0], "remove") == 0 && argc == 2) {
+		image_remove(img);
+		ctl_reply(c, "ok");
+	} else if (strcmp(argv[0], "save") == 0 && argc <= 2) {
+		if (argc == 1 && !session_file) {
+			ctl_reply(c, "error: no session file");
+			return;
 		}
+		/* answered once written */
+		c->saving = write_session(argc == 2 ? argv[1] : session_file);
+		if (!c->saving)
+			ctl_reply(c, "error: %s: cannot save", argc == 2 ? argv[1] : session_file);
+	} else if (strcmp(argv[0], "query") == 0 && argc == 1) {
+		for (i = 0; i < image_count; i++) {
+			img = &images[i];
+			ctl_reply(c, "%lu %d %d %f %zu %zu '%s'", img->id,
+				  img->posx + (int)img->width / 2,
+				  img->posy + (int)img->height / 2,
+				  img->scale, img->width, img->height, img->path);
+		}
+		ctl_reply(c, "ok %zu", image_count);
+	} else if (strcmp(argv[0], "arrange") == 0 && argc == 1) {
+		arrange();
+		ctl_reply(c, "ok");
+	} else if (strcmp(argv[0], "pixels") == 0) {
+		ctl_pixels(c, argc, argv);
+	} else {
+		ctl_reply(c, "error: %s: bad command", argv[0]);
 	}
-	load_at(file, x, y, scale);
 }
 
-static void
-parse_line(char *l)
+/* run the commands read, returns 1 if any */
+static int
+ctl_run(struct client *c)
 {
 	const char *argv[16];
-	size_t argc = 0;
-	char *e;
-
-	do {
-		l = strtrim(l);
-		if (*l == '\0') break;
-		e = argsplit(l);
-		argv[argc++] = l;
-		l = e;
-	} while (l != NULL && argc < LEN(argv));
-	if (argc > 0)
-		open_file(argc, argv);
+	char *l, *e, *end;
+	size_t argc, used = 0;
+	int ran = 0;
+
+	/* the commands after a save wait for it to be written */
+	while (!c->saving && (end = memchr(c->in + used, '\n', c->inlen - used))) {
+		*end = '\0';
+		l = c->in + used;
+		used = end + 1 - c->in;
+		argc = 0;
+		do {
+			l = strtrim(l);
+			if (*l == '\0')
+				break;
+			e = argsplit(l);
+			argv[argc++] = l;
+			l = e;
+		} while (l != NULL && argc < LEN(argv));
+		if (argc > 0) {
+			ctl_command(c, argc, argv);
+			ran = 1;
+		}
+	}
+	c->inlen -= used;
+	memmove(c->in, c->in + used, c->inlen);
+	if (!c->saving && c->inlen >= CTL_LINE) {
+		ctl_reply(c, "error: line too long");
+		c->inlen = 0;
+		c->eof = 1;
+	}
+	return ran;
 }
 
+/* keep the descriptors sent along */
 static void
-read_session(const char *name)
+ctl_fds(struct client *c, struct msghdr *msg)
 {
-	char *line = NULL;
-	size_t n = 0;
-	ssize_t l;
-	FILE *f;
+	struct cmsghdr *cm;
+	size_t i, n;
+	int fd;
 
-	if (!name)
-		return;
-	f = fopen(name, "r");
-	if (!f) {
-		if (errno == ENOENT)
-			err("%s: %s\n", name, strerror(errno));
-		else
-			die("%s: %s\n", name, strerror(errno));
-		return;
+	for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+			continue;
+		n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < n; i++) {
+			memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+			if (c->nfds < LEN(c->fds))
+				c->fds[c->nfds++] = fd;
+			else
+				close(fd);
+		}
 	}
+}
 
-	while ((l = getline(&line, &n, f)) != -1) {
-		char *p;
-		p = strchr(line, '#');
-		if (p) *p = '\0';
-		p = strchr(line, '\n');
-		if (p) *p = '\0';
-		parse_line(line);
+/* returns -1 once the client is gone */
+static int
+ctl_read(struct client *c)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(CTL_FDS * sizeof(int))];
+	} u;
+	struct msghdr msg = { 0 };
+	struct iovec iov;
+	ssize_t n;
+
+	while (c->inlen < CTL_READ) {
+		iov.iov_base = c->in + c->inlen;
+		iov.iov_len = CTL_READ - c->inlen;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = u.buf;
+		msg.msg_controllen = sizeof(u.buf);
+		n = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+		if (n >= 0)
+			ctl_fds(c, &msg);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return errno == EAGAIN ? 0 : -1;
+		if (n == 0) {
+			c->eof = 1;
+			break;
+		}
+		c->inlen += n;
 	}
-	free(line);
-	fclose(f);
+	return 0;
+}
+
+/* returns -1 once the client is gone */
+static int
+ctl_flush(struct client *c)
+{
+	ssize_t n;
+
+	while (c->outlen > 0) {
+		n = send(c->fd, c->out, c->outlen, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return errno == EAGAIN ? 0 : -1;
+		c->outlen -= n;
+		memmove(c->out, c->out + n, c->outlen);
+	}
+	return c->eof && !c->saving ? -1 : 0;
 }
 
 static void
-write_session(const char *name)
+ctl_pollfds(struct pollfd *p)
 {
 	size_t i;
-	FILE *f;
 
-	if (!name)
-		return;
-	f = fopen(name, "w");
-	if (!f) {
-		err("%s: %s\n", name, strerror(errno));
-		return;
+	p[0].fd = ctlfd;
+	p[0].events = POLLIN;
+	for (i = 0; i < LEN(clients); i++) {
+		p[i + 1].fd = ctlfd < 0 ? -1 : clients[i].fd;
+		if (clients[i].saving && !clients[i].outlen)
+			p[i + 1].fd = -1; /* not read until saved */
+		p[i + 1].events = clients[i].outlen ? POLLOUT : POLLIN;
 	}
+}
 
-	fprintf(f, "#!%s -f\n", argv0);
-	for (i = 0; i < image_count; i++) {
-		const char *p = images[i].path;
-		int x = images[i].posx + images[i].width / 2;
-		int y = images[i].posy + images[i].height / 2;
-		float s = images[i].scale;
-		fprintf(f, "'%s' x=%d y=%d scale=%f\n", p, x, y, s);
+/* answer the client waiting for the save */
+static void
+ctl_saved(unsigned long serial, const char *name, int error)
+{
+	size_t i;
+
+	for (i = 0; ctlfd >= 0 && i < LEN(clients); i++) {
+		if (clients[i].fd < 0 || clients[i].saving != serial)
+			continue;
+		if (error)
+			ctl_reply(&clients[i], "error: %s: %s", name, strerror(error));
+		else
+			ctl_reply(&clients[i], "ok");
+		clients[i].saving = 0;
 	}
-	fclose(f);
+}
+
+/* returns 1 if the board changed */
+static int
+ctl_poll(const struct pollfd *p)
+{
+	struct client *c;
+	size_t i;
+	int ran = 0;
+
+	if (ctlfd < 0)
+		return 0;
+	for (i = 0; i < LEN(clients); i++) {
+		c = &clients[i];
+		if (c->fd < 0 || p[i + 1].fd != c->fd)
+			continue;
+		if ((p[i + 1].revents & POLLOUT) && ctl_flush(c) < 0)
+			ctl_close(c);
+		else if ((p[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) && ctl_read(c) < 0)
+			ctl_close(c);
+	}
+	/* the commands of all the clients, drawn in a single frame */
+	for (i = 0; i < LEN(clients); i++) {
+		c = &clients[i];
+		if (c->fd < 0)
+			continue;
+		ran |= ctl_run(c);
+		if ((c->outlen || c->eof) && ctl_flush(c) < 0)
+			ctl_close(c);
+	}
+	if (p[0].revents & POLLIN)
+		ctl_accept();
+	return ran;
 }
 
 static void
 usage(void)
 {
-	printf("usage: %s [-hv] [--] [[+<X>x<Y>] files ...]\n", argv0);
+	printf("usage: %s [-htv] [-c socket] [-i stream] [--] [[+<X>x<Y>] files ...]\n", argv0);
 	exit(1);
 }
 
@@ -1175,15 +7499,29 @@ main(int argc, char **argv)
 	case 'f':
 		session_file = EARGF(usage());
 		break;
+	case 't':
+		showstats = 1;
+		break;
+	case 'c':
+		ctl_file = EARGF(usage());
+		break;
+	case 'i':
+		stream_file = EARGF(usage());
+		break;
 	case 'h':
 	default:
 		usage();
 	} ARGEND;
 
 	init();
+	notify_init();
 	/* glX needs to be initialized */
-	if (session_file)
+	if (session_file) {
 		read_session(session_file);
+		stat(session_file, &sessionst);
+		watch_path(session_file);
+		journal_open();
+	}
 
 	x = 0, y = 0;
 	for (i = 0; i < argc; i++) {
@@ -1194,8 +7532,19 @@ main(int argc, char **argv)
 		load_at(argv[i], x, y, 1.0);
 		x = 0, y = 0;
 	}
+	if (stream_file && stream_open(stream_file) < 0)
+		die("%s: %s\n", stream_file, strerror(errno));
+	if (ctl_file)
+		ctl_init(ctl_file);
 
 	run();
+	session_flush();
+	if (ctl_file)
+		unlink(ctl_file);
+	if (journal.fd >= 0)
+		fdatasync(journal.fd);
+	if (showstats)
+		upload_report();
 
 	glXMakeCurrent(dpy, 0, 0);
 	glXDestroyContext(dpy, ctx);
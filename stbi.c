@@ -1,2 +1,18 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+
+/*
+ * Inflate at most olen bytes of a zlib stream, unlike
+ * stbi_zlib_decode_buffer() the bytes decoded so far are returned
+ * when the output buffer is too small.
+ */
+int
+stbi_zlib_decode_prefix(char *obuffer, int olen, char const *ibuffer, int ilen)
+{
+	stbi__zbuf a;
+
+	a.zbuffer = (stbi_uc *)ibuffer;
+	a.zbuffer_end = (stbi_uc *)ibuffer + ilen;
+	stbi__do_zlib(&a, obuffer, olen, 0, 1);
+	return (int)(a.zout - a.zout_start);
+}